@@ -36,6 +36,7 @@
 
 #include <asm/nmi.h>
 #include <asm/msr.h>
+#include <asm/apic.h>
 
 #include <linux/smp.h>
 #include <linux/init.h>
@@ -46,15 +47,24 @@
 #include <linux/string.h>
 #include <linux/percpu.h>
 #include <linux/cpumask.h>
+#include <linux/rcupdate.h>
+#include <linux/version.h>
+#include <linux/cpu.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#include <linux/cpuhotplug.h>
+#endif
 
 #define __MSR_IA32_PMC0				0x0C1
+#define __MSR_IA32_PMC1				0x0C2
 #define __MSR_IA32_PERFEVTSEL0			0x186
+#define __MSR_IA32_PERFEVTSEL1			0x187
 #define __MSR_CORE_PERF_GLOBAL_STATUS		0x38E
 #define __MSR_CORE_PERF_GLOBAL_CTRL		0x38F
 
 #define __MSR_IA32_MISC_PERFMON_ENABLE		(1ULL<<7)
 #define __MSR_CORE_PERF_GLOBAL_OVF_CTRL		0x390
 #define __MSR_IA32_MISC_ENABLE			0x1A0
+#define __MSR_OFFCORE_RSP_0			0x1A6
 
 /* Bit layout of MSR_IA32_PERFEVTSEL */
 #define USR_MODE				(1ULL<<16)
@@ -88,6 +98,29 @@ enum PERF_EVENT_ID {
 	EVENT_COUNT_MAX,
 };
 
+/*
+ * CYCLE_ACTIVITY.STALLS_L2_PENDING (Haswell)
+ * Execution stalls while at least one L2 miss demand load is outstanding.
+ * This is how much of the miss latency is really exposed to the pipeline,
+ * it is counted by PMC1 alongside LLC_MISSES in PMC0.
+ */
+#define STALLS_L2_PENDING			(0x05a3 | CMASK(5ULL))
+
+/*
+ * OFFCORE_RESPONSE_0 (Haswell-EP)
+ * Offcore requests matching the request type and response type bits in
+ * __MSR_OFFCORE_RSP_0. Here: data reads and RFOs, demand and prefetch,
+ * which missed LLC and were served by DRAM of the other socket. Unlike
+ * HA counters, the request is counted by the very core who issued it.
+ */
+#define OFFCORE_RESPONSE_0			0x01b7
+#define OFFCORE_RSP_ALL_DATA_RD			0x0091ULL
+#define OFFCORE_RSP_ALL_RFO			0x0122ULL
+#define OFFCORE_RSP_LLC_MISS_REMOTE_DRAM	0x063f800000ULL
+#define OFFCORE_RSP_REMOTE_DRAM			(OFFCORE_RSP_ALL_DATA_RD	\
+						| OFFCORE_RSP_ALL_RFO		\
+						| OFFCORE_RSP_LLC_MISS_REMOTE_DRAM)
+
 /* UMASK and Event Select */
 const static u64 predefined_event_map[EVENT_COUNT_MAX] =
 {
@@ -120,8 +153,32 @@ static struct pre_event pre_event_info = {
 
 /* The interface */
 u64 pre_event_init_value;
+EXPORT_SYMBOL(pre_event_init_value);
+
+/* What PMC0 counts, one of CORE_PMU_SOURCE_XXX */
+unsigned int core_pmu_source;
+EXPORT_SYMBOL(core_pmu_source);
 
 DEFINE_PER_CPU(u64, PERCPU_NMI_TIMES);
+EXPORT_PER_CPU_SYMBOL(PERCPU_NMI_TIMES);
+
+/*
+ * Monotonic LLC misses seen by each cpu, in steps of the sampling interval.
+ * Unlike PERCPU_NMI_TIMES, it is never cleared from /proc, so clients like
+ * the NVM emulator can take deltas across interval changes safely.
+ */
+DEFINE_PER_CPU(u64, PERCPU_LLC_MISSES);
+EXPORT_PER_CPU_SYMBOL(PERCPU_LLC_MISSES);
+
+/*
+ * Monotonic memory stall cycles of each cpu, harvested from PMC1 whenever
+ * PMC0 overflows. Same granularity as PERCPU_LLC_MISSES.
+ */
+DEFINE_PER_CPU(u64, PERCPU_STALL_CYCLES);
+EXPORT_PER_CPU_SYMBOL(PERCPU_STALL_CYCLES);
+
+/* Client hooked into overflow NMI, e.g. the NVM emulator */
+static core_pmu_overflow_fn __rcu core_pmu_overflow_handler;
 
 void core_pmu_clear_counter(void)
 {
@@ -246,6 +303,11 @@ static void __core_pmu_show_msrs(void *info)
 	pr_info("CPU %d: PMC0=%llx PERFEVTSEL0=%llx\n",
 		smp_processor_id(), tmsr1, tmsr2);
 
+	tmsr1 = core_pmu_rdmsr(__MSR_IA32_PMC1);
+	tmsr2 = core_pmu_rdmsr(__MSR_IA32_PERFEVTSEL1);
+	pr_info("CPU %d: PMC1=%llx PERFEVTSEL1=%llx\n",
+		smp_processor_id(), tmsr1, tmsr2);
+
 	tmsr1 = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
 	tmsr2 = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_STATUS);
 	tmsr3 = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_OVF_CTRL);
@@ -257,6 +319,8 @@ static void __core_pmu_clear_msrs(void *info)
 {
 	core_pmu_wrmsr(__MSR_IA32_PMC0, 0x0);
 	core_pmu_wrmsr(__MSR_IA32_PERFEVTSEL0, 0x0);
+	core_pmu_wrmsr(__MSR_IA32_PMC1, 0x0);
+	core_pmu_wrmsr(__MSR_IA32_PERFEVTSEL1, 0x0);
 	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, 0x0);
 	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_OVF_CTRL, 0x0);
 }
@@ -269,11 +333,11 @@ static void __core_pmu_clear_msrs(void *info)
  * true; counting is disabled when the result is false.
  *
  * Bit 0 in __MSR_CORE_PERF_GLOBAL_CTRL is responsiable
- * for enable/disable __MSR_IA32_PMC0
+ * for enable/disable __MSR_IA32_PMC0, bit 1 for __MSR_IA32_PMC1
  */
 static void __core_pmu_enable_counting(void *info)
 {
-	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, 1);
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, 0x3);
 }
 
 static void __core_pmu_disable_counting(void *info)
@@ -289,7 +353,7 @@ static void __core_pmu_clear_ovf(void *info)
 static void __core_pmu_enable_predefined_event(void *info)
 {
 	int evt;
-	u64 val;
+	u64 val, sel;
 
 	if (!info)
 		return;
@@ -302,12 +366,26 @@ static void __core_pmu_enable_predefined_event(void *info)
 	/* 48-bit Mask, in case #GP occurs */
 	val &= (1ULL<<48)-1;
 
+	/* Remote DRAM source overrides the predefined event */
+	sel = predefined_event_map[evt];
+	if (core_pmu_source == CORE_PMU_SOURCE_REMOTE_DRAM) {
+		core_pmu_wrmsr(__MSR_OFFCORE_RSP_0, OFFCORE_RSP_REMOTE_DRAM);
+		sel = OFFCORE_RESPONSE_0;
+	}
+
 	core_pmu_wrmsr(__MSR_IA32_PMC0, val);
 	core_pmu_wrmsr(__MSR_IA32_PERFEVTSEL0,
-				predefined_event_map[evt]
+				sel
 				| USR_MODE
 				| INT_ENABLE
 				| ENABLE );
+
+	/* Counting only, harvested by overflow of PMC0 */
+	core_pmu_wrmsr(__MSR_IA32_PMC1, 0);
+	core_pmu_wrmsr(__MSR_IA32_PERFEVTSEL1,
+				STALLS_L2_PENDING
+				| USR_MODE
+				| ENABLE );
 }
 
 static void __core_pmu_lapic_init(void *info)
@@ -390,6 +468,100 @@ static void core_pmu_lapic_init(void)
 	}
 }
 
+//#################################################
+//	CPU Hotplug
+//#################################################
+
+/*
+ * Everything above only walks cpus online at the time of the call. Cpus
+ * which come online later, e.g. those brought back by the NVM emulator,
+ * would be left with PMC0 stopped and LVTPC not delivering NMIs. Set them
+ * up the same way as the others when they come online, and quiet them down
+ * when they go offline.
+ */
+static void __core_pmu_cpu_online(void *info)
+{
+	__core_pmu_lapic_init(NULL);
+	__core_pmu_clear_msrs(NULL);
+
+	/* 0 means sampling is disabled, see core_proc.c */
+	if (pre_event_init_value) {
+		__core_pmu_enable_predefined_event(&pre_event_info);
+		__core_pmu_enable_counting(NULL);
+	}
+}
+
+static void __core_pmu_cpu_offline(void *info)
+{
+	__core_pmu_clear_msrs(NULL);
+	apic_write(APIC_LVTPC, APIC_DM_NMI | APIC_LVT_MASKED);
+}
+
+static int core_pmu_cpu_online(unsigned int cpu)
+{
+	core_pmu_cpu_function_call(cpu, __core_pmu_cpu_online, NULL);
+	return 0;
+}
+
+static int core_pmu_cpu_offline(unsigned int cpu)
+{
+	core_pmu_cpu_function_call(cpu, __core_pmu_cpu_offline, NULL);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+static int core_pmu_hp_state;
+
+static int core_pmu_register_hotplug(void)
+{
+	int ret;
+
+	ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "core_pmu:online",
+					core_pmu_cpu_online, core_pmu_cpu_offline);
+	if (ret < 0)
+		return ret;
+
+	core_pmu_hp_state = ret;
+	return 0;
+}
+
+static void core_pmu_unregister_hotplug(void)
+{
+	cpuhp_remove_state_nocalls(core_pmu_hp_state);
+}
+#else
+static int core_pmu_cpu_notify(struct notifier_block *nb,
+			       unsigned long action, void *hcpu)
+{
+	unsigned int cpu = (unsigned long)hcpu;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_ONLINE:
+	case CPU_DOWN_FAILED:
+		core_pmu_cpu_online(cpu);
+		break;
+	case CPU_DOWN_PREPARE:
+		core_pmu_cpu_offline(cpu);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block core_pmu_cpu_nb = {
+	.notifier_call	= core_pmu_cpu_notify,
+};
+
+static int core_pmu_register_hotplug(void)
+{
+	return register_cpu_notifier(&core_pmu_cpu_nb);
+}
+
+static void core_pmu_unregister_hotplug(void)
+{
+	unregister_cpu_notifier(&core_pmu_cpu_nb);
+}
+#endif
+
 //#################################################
 //	PMU NMI Handler
 //#################################################
@@ -397,20 +569,64 @@ static void core_pmu_lapic_init(void)
 static int core_pmu_nmi_handler(unsigned int type, struct pt_regs *regs)
 {
 	u64 tmsr = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_STATUS);
+	core_pmu_overflow_fn handler;
+	u64 stalls;
 	
 	if (!(tmsr & 0x1)) /* No overflow on *this* CPU */
 		return NMI_DONE;
 
+	/* Harvest PMC1 before it is cleared below */
+	stalls = core_pmu_rdmsr(__MSR_IA32_PMC1) & ((1ULL<<48)-1);
+
 	/* Restart counting on *this* cpu. */
 	__core_pmu_clear_msrs(NULL);
 	__core_pmu_enable_predefined_event(&pre_event_info);
 	__core_pmu_enable_counting(NULL);
 
 	this_cpu_inc(PERCPU_NMI_TIMES);
+	this_cpu_add(PERCPU_LLC_MISSES, -pre_event_init_value);
+	this_cpu_add(PERCPU_STALL_CYCLES, stalls);
+
+	/* NMIs are sched-RCU readers, plain RCU does not wait for them */
+	handler = rcu_dereference_sched(core_pmu_overflow_handler);
+	if (handler)
+		handler(-pre_event_init_value, stalls);
 
 	return NMI_HANDLED;
 }
 
+/**
+ * core_pmu_register_overflow_handler
+ * @handler:	the function to call on every overflow
+ * Return:	0 on success
+ *
+ * Hook @handler into the overflow NMI. It is called in NMI context on the cpu
+ * which overflowed, with the number of LLC misses this overflow stands for,
+ * and the memory stall cycles seen since last overflow.
+ * Only one client is supported, and @handler must be NMI-safe.
+ */
+int core_pmu_register_overflow_handler(core_pmu_overflow_fn handler)
+{
+	if (rcu_access_pointer(core_pmu_overflow_handler))
+		return -EBUSY;
+
+	rcu_assign_pointer(core_pmu_overflow_handler, handler);
+	return 0;
+}
+EXPORT_SYMBOL(core_pmu_register_overflow_handler);
+
+/**
+ * core_pmu_unregister_overflow_handler
+ *
+ * Unhook the client. When this returns, no cpu is running the old handler.
+ */
+void core_pmu_unregister_overflow_handler(void)
+{
+	RCU_INIT_POINTER(core_pmu_overflow_handler, NULL);
+	synchronize_sched();
+}
+EXPORT_SYMBOL(core_pmu_unregister_overflow_handler);
+
 static void core_pmu_regitser_nmi_handler(void)
 {
 	/* We must *avoid* walking kernel code path as much as possiable.
@@ -444,6 +660,26 @@ void core_pmu_start_sampling(void)
 	core_pmu_enable_counting();
 }
 
+/**
+ * core_pmu_set_source
+ * @source:	one of CORE_PMU_SOURCE_XXX
+ * Return:	0 on success
+ *
+ * Choose what PMC0 counts, and so what PERCPU_LLC_MISSES stands for.
+ * Sampling is restarted on all online cpus, unless it is disabled.
+ */
+int core_pmu_set_source(unsigned int source)
+{
+	if (source >= CORE_PMU_SOURCE_MAX)
+		return -EINVAL;
+
+	core_pmu_source = source;
+	if (pre_event_init_value)
+		core_pmu_start_sampling();
+	return 0;
+}
+EXPORT_SYMBOL(core_pmu_set_source);
+
 static int core_pmu_init(void)
 {
 	int ret;
@@ -474,12 +710,24 @@ static int core_pmu_init(void)
 	 * changed to 0 to avoid overflow, which means disable latency simulation.
 	 */
 	pre_event_init_value	= -256;
+	core_pmu_source		= CORE_PMU_SOURCE_LLC_MISSES;
 	PMU_LATENCY		= CPU_BASE_FREQUENCY*10;
 
 	/*
 	 * Start sampling using (-256) LLC misses interval
 	 */
 	core_pmu_start_sampling();
+
+	/*
+	 * Cpus which come online from now on are set up by the callback
+	 */
+	ret = core_pmu_register_hotplug();
+	if (ret) {
+		core_pmu_clear_msrs();
+		core_pmu_unregister_nmi_handler();
+		core_pmu_proc_remove();
+		return ret;
+	}
 	
 	return 0;
 }
@@ -493,11 +741,13 @@ static void core_pmu_exit(void)
 	core_pmu_proc_remove();
 
 	/* Clear PMU of all CPU
-	 * We only walk through online CPUS, if someone offline some CPUs
-	 * before this call, then those CPUs will have residual PMU state.
+	 * Offline CPUs were cleared by the hotplug callback when they went
+	 * down, and nothing sets them up again once it is gone.
 	 */
+	core_pmu_unregister_hotplug();
 	core_pmu_clear_msrs();
 	core_pmu_unregister_nmi_handler();
+	core_pmu_unregister_overflow_handler();
 }
 
 module_init(core_pmu_init);
@@ -83,10 +83,59 @@ void core_pmu_clear_counter(void);
 int core_pmu_proc_create(void);
 void core_pmu_proc_remove(void);
 
+/*
+ * CORE_PMU_SOURCE_LLC_MISSES:
+ *	Architectural LLC_MISSES, whatever memory serves them.
+ * CORE_PMU_SOURCE_REMOTE_DRAM:
+ *	OFFCORE_RESPONSE, reads and RFOs served by DRAM of the other socket.
+ *	Each core counts its own requests to the remote node.
+ */
+enum {
+	CORE_PMU_SOURCE_LLC_MISSES,
+	CORE_PMU_SOURCE_REMOTE_DRAM,
+
+	CORE_PMU_SOURCE_MAX,
+};
+
+int core_pmu_set_source(unsigned int source);
+
+typedef void (*core_pmu_overflow_fn)(u64 misses, u64 stall_cycles);
+int core_pmu_register_overflow_handler(core_pmu_overflow_fn handler);
+void core_pmu_unregister_overflow_handler(void);
+
 struct pre_event {
 	int event;
 	u64 threshold;
 };
 
 extern u64 pre_event_init_value;
+extern unsigned int core_pmu_source;
 DECLARE_PER_CPU(u64, PERCPU_NMI_TIMES);
+DECLARE_PER_CPU(u64, PERCPU_LLC_MISSES);
+DECLARE_PER_CPU(u64, PERCPU_STALL_CYCLES);
+
+/**
+ * core_pmu_llc_misses
+ * @cpu:	the cpu in question
+ *
+ * LLC misses accounted on @cpu since core.ko was loaded. The granularity is
+ * -(pre_event_init_value) misses, since we only learn about them on overflow.
+ * With CORE_PMU_SOURCE_REMOTE_DRAM, only misses to the remote node count.
+ * It is safe to call from any cpu.
+ */
+static inline u64 core_pmu_llc_misses(int cpu)
+{
+	return READ_ONCE(per_cpu(PERCPU_LLC_MISSES, cpu));
+}
+
+/**
+ * core_pmu_stall_cycles
+ * @cpu:	the cpu in question
+ *
+ * Cycles @cpu stalled on outstanding L2 misses, updated together with
+ * core_pmu_llc_misses(). It is safe to call from any cpu.
+ */
+static inline u64 core_pmu_stall_cycles(int cpu)
+{
+	return READ_ONCE(per_cpu(PERCPU_STALL_CYCLES, cpu));
+}
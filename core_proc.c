@@ -29,7 +29,7 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 
-const char pmu_proc_format[] = "CPU %2d, NMI times = %lld\n";
+const char pmu_proc_format[] = "CPU %2d, NMI times = %lld, stall cycles = %lld\n";
 
 static int core_pmu_proc_show(struct seq_file *m, void *v)
 {
@@ -37,10 +37,14 @@ static int core_pmu_proc_show(struct seq_file *m, void *v)
 
 	seq_printf(m, "Counter init value: %lld 0x%llx\n",
 		(s64)pre_event_init_value, pre_event_init_value);
+	seq_printf(m, "Counting: %s\n",
+		core_pmu_source == CORE_PMU_SOURCE_REMOTE_DRAM ?
+		"remote DRAM (OFFCORE_RESPONSE)" : "LLC_MISSES");
 
 	for_each_online_cpu(cpu) {
 		seq_printf(m, pmu_proc_format, cpu,
-			per_cpu(PERCPU_NMI_TIMES, cpu));
+			per_cpu(PERCPU_NMI_TIMES, cpu),
+			per_cpu(PERCPU_STALL_CYCLES, cpu));
 	}
 	
 	return 0;
@@ -95,6 +99,12 @@ static ssize_t core_pmu_proc_write(struct file *file, const char __user *buf,
 			core_pmu_clear_counter();
 			core_pmu_start_sampling();
 			break;
+		case 'l': /* count all LLC misses */
+			core_pmu_set_source(CORE_PMU_SOURCE_LLC_MISSES);
+			break;
+		case 'r': /* count misses served by remote DRAM */
+			core_pmu_set_source(CORE_PMU_SOURCE_REMOTE_DRAM);
+			break;
 		default:
 			count = -EINVAL;
 	}
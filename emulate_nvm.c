@@ -19,148 +19,886 @@
 #define pr_fmt(fmt) fmt
 
 #include "uncore_pmu.h"
+#include "core_pmu.h"
 #include "emulate_nvm.h"
+#include "uncore_ring.h"
 
 #include <linux/cpu.h>
 #include <linux/init.h>
 #include <linux/list.h>
+#include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/mutex.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/nodemask.h>
+#include <linux/irq_work.h>
+#include <linux/atomic.h>
+#include <linux/timex.h>
+#include <linux/rcupdate.h>
 
-/* TODO more general. */
-extern struct uncore_event ha_requests_local_reads;
-extern struct uncore_event ha_requests_remote_reads;
+#include <asm/tsc.h>
 
-/* Latency model */
-u64 dram_read_latency_ns;
-u64 nvm_read_latency_ns;
-u64 read_latency_delta_ns;
+/* Default events, any HA event in catalog could be chosen at runtime */
+#define EMULATE_NVM_READ_EVENT		"UNC_H_REQUESTS.READS_REMOTE"
+#define EMULATE_NVM_WRITE_EVENT		"UNC_H_REQUESTS.WRITES_REMOTE"
+#define EMULATE_NVM_IMC_READ_EVENT	"UNC_H_IMC_READS.NORMAL"
 
-unsigned int polling_cpu;
-unsigned int polling_node;
-unsigned int emulate_nvm_cpu;
-unsigned int emulate_nvm_node;
+/* Every NVM access moves a cacheline */
+#define EMULATE_NVM_LINE_BYTES		64
 
-u64 emulate_nvm_hrtimer_duration_ns;
+/*
+ * EMULATE_NVM_MODEL_LINEAR:
+ *	Every read miss stalls the whole read latency delta.
+ * EMULATE_NVM_MODEL_MLP:
+ *	Scale the delta by memory stall cycles really exposed to pipeline,
+ *	overlapping misses are charged once. See counts_to_delay_ns.
+ *
+ * EMULATE_NVM_MODE_HA:
+ *	The HA box of NVM node counts remote reads, all of them are charged
+ *	to the single emulate_nvm_cpu.
+ * EMULATE_NVM_MODE_PERCPU:
+ *	Every cpu in config cpus is charged from its own LLC misses,
+ *	which are counted by core.ko.
+ * EMULATE_NVM_MODE_LOCAL:
+ *	Like Per-CPU mode, but the delay is injected on the spot by the
+ *	overflow NMI of core.ko, every -(pre_event_init_value) misses.
+ *	Polling cpu only keeps an eye on HA counters.
+ *
+ * The config in effect is only replaced by the polling cpu, at epoch
+ * boundary. Readers run in hrtimer, irq_work and NMI context, hence the
+ * sched flavor of RCU. A config published by emulate_nvm_set_config() waits
+ * in emulate_nvm_next_config until then. emulate_nvm_shadow_config is what
+ * was asked for last, the base of the next request.
+ */
+struct emulate_nvm_config __rcu *emulate_nvm_config;
+static struct emulate_nvm_config *emulate_nvm_next_config;
+static struct emulate_nvm_config emulate_nvm_shadow_config;
+static DEFINE_MUTEX(emulate_nvm_config_mutex);
+
+DEFINE_PER_CPU(u64, emulate_nvm_last_misses);
+DEFINE_PER_CPU(u64, emulate_nvm_last_stalls);
+static DEFINE_PER_CPU(u64, emulate_nvm_epoch_misses);
+
+/*
+ * Cumulative delay the model asked for, and the delay really injected.
+ * The difference is the debt, carried over to the next epoch. The debt
+ * goes negative if we overshot, which is paid back next time as well.
+ */
+DEFINE_PER_CPU(u64, emulate_nvm_model_delay_ns);
+DEFINE_PER_CPU(u64, emulate_nvm_total_delay_ns);
+DEFINE_PER_CPU(s64, emulate_nvm_debt_ns);
+
+/*
+ * Mailbox of each emulated cpu. Polling cpu posts delay into it and kicks
+ * the irq_work of that cpu, without waiting. Overflow NMI posts misses of
+ * its own cpu (Local mode). The irq_work drains everything at once.
+ */
+static DEFINE_PER_CPU(atomic64_t, emulate_nvm_mailbox_ns);
+static DEFINE_PER_CPU(u64, emulate_nvm_pending_misses);
+static DEFINE_PER_CPU(u64, emulate_nvm_pending_stalls);
+static DEFINE_PER_CPU(struct irq_work, emulate_nvm_work);
+static bool overflow_handler_registed = false;
+
+/* CPUs we took down, and have to bring back */
+static struct cpumask offlined_cpus;
+
+/*
+ * Take down cpus which would pollute HA counters, see
+ * prepare_platform_configuration. With offline_cpus=0, everything stays
+ * online and core.ko counts remote DRAM accesses of each core instead.
+ * HA mode is not accurate then, use Per-CPU or Local mode.
+ */
+static bool offline_cpus = true;
+module_param(offline_cpus, bool, 0444);
+MODULE_PARM_DESC(offline_cpus, "Offline cpus not being emulated (default: 1)");
+
+/*
+ * The socket whose memory plays NVM. Its HA box counts the accesses, and
+ * the polling cpu sits on it. Emulated cpus run on other sockets.
+ */
+static unsigned int nvm_node = 1;
+module_param(nvm_node, uint, 0444);
+MODULE_PARM_DESC(nvm_node, "NUMA node emulated as NVM (default: 1)");
+
+/* Counting source of core.ko before we changed it, if we did */
+static unsigned int saved_core_pmu_source;
+static bool core_pmu_source_saved = false;
+
+/*
+ * Adaptive epoch. Aim at epoch_target HA counts per epoch, within
+ * [epoch_min_ns, epoch_max_ns]. Zero epoch_target means fixed epoch.
+ * emulate_nvm_epoch_ns is the duration chosen for the current epoch.
+ */
+u64 emulate_nvm_epoch_ns;
 
 u64 hrtimer_jiffies;
 
 static bool emulation_started = false;
 static bool latency_started = false;
-static struct uncore_box *HA_Box_0, *HA_Box_1;
-static struct uncore_event *event;
+static struct uncore_box *HA_Box_NVM;
+
+/* Counters of the HA event group, assigned by uncore_box_add_event */
+static int read_ctr, write_ctr, imc_read_ctr;
+
+/*
+ * Don't poll other sockets from the polling cpu. With socket_pollers=0,
+ * the polling cpu does everything itself, as it used to.
+ */
+static bool socket_pollers = true;
+module_param(socket_pollers, bool, 0444);
+MODULE_PARM_DESC(socket_pollers, "Poll each socket from a cpu of its own (default: 1)");
+
+/**
+ * struct emulate_nvm_poller
+ * @hrtimer:		pinned to @cpu
+ * @cpu:		cpu running @hrtimer
+ * @nodeid:		socket of @snapshot
+ * @served:		sockets whose emulated cpus this poller charges
+ * @duration:		length of current epoch
+ * @misses:		misses charged so far, read by other pollers
+ * @last_reads:		emulate_nvm_nvm_reads at last epoch
+ * @last_writes:	emulate_nvm_nvm_writes at last epoch
+ * @last_write_over:	emulate_nvm_write_over_ns at last epoch
+ * @last_bw_over:	emulate_nvm_bw_over_ns at last epoch
+ * @last_all_misses:	misses of all pollers at last epoch
+ * @snapshot:		bound boxes of @nodeid
+ *
+ * Every socket is polled by a cpu of its own, which reads local boxes and
+ * charges local emulated cpus only. The master polls the NVM node: it reads
+ * the HA box, publishes NVM counts, swaps configs and chooses the epoch.
+ * Other pollers pick NVM counts up from there, no lock is taken and nobody
+ * waits. Sockets without a spare cpu are served by the master.
+ */
+struct emulate_nvm_poller {
+	struct hrtimer		hrtimer;
+	unsigned int		cpu;
+	unsigned int		nodeid;
+	nodemask_t		served;
+	u64			duration;
+	u64			misses;
+	u64			last_reads;
+	u64			last_writes;
+	u64			last_write_over;
+	u64			last_bw_over;
+	u64			last_all_misses;
+	struct uncore_snapshot	snapshot;
+};
+
+static struct emulate_nvm_poller *emulate_nvm_master;
+static struct emulate_nvm_poller *emulate_nvm_helpers[UNCORE_MAX_SOCKET];
+
+/* Cpus polling sockets other than the NVM node, they are never emulated */
+struct cpumask emulate_nvm_helper_cpus;
+
+/* NVM accesses counted so far, only the master writes them */
+static u64 emulate_nvm_nvm_reads, emulate_nvm_nvm_writes;
+
+/* Stall owed to writers for going beyond the write ceiling, same as above */
+u64 emulate_nvm_write_over_ns;
+
+/* Stall owed to all NVM consumers, if NVM node is throttled in software */
+u64 emulate_nvm_bw_over_ns;
+
+/* Whether @cpu was charged last epoch, by the only poller serving it */
+static DEFINE_PER_CPU(bool, emulate_nvm_charged);
+
+/*
+ * Upper bound of a single stall. We are running with irq disabled, anything
+ * beyond this is left as debt and paid in the next epoch.
+ */
+#define EMULATE_NVM_MAX_STALL_NS	(10 * NSEC_PER_MSEC)
+
+/*
+ * udelay() works in microseconds and drops everything below, which is not
+ * acceptable for epochs of tens of microseconds. Spin on TSC instead, the
+ * kernel has calibrated tsc_khz for us. Return what was really stalled.
+ */
+static u64 emulate_nvm_stall_ns(u64 ns)
+{
+	cycles_t start, now, cycles;
+
+	cycles = div_u64(ns * tsc_khz, 1000000);
+
+	start = get_cycles();
+	do {
+		cpu_relax();
+		now = get_cycles();
+	} while (now - start < cycles);
+
+	return div_u64((now - start) * 1000000, tsc_khz);
+}
+
+/*
+ * Charge @delay_ns to current cpu, together with the debt of past epochs.
+ * Cumulative injected time follows cumulative modeled time exactly, errors
+ * of a single stall never accumulate.
+ */
+static void emulate_nvm_charge(u64 delay_ns)
+{
+	s64 debt;
+	u64 stalled = 0;
+
+	this_cpu_add(emulate_nvm_model_delay_ns, delay_ns);
+
+	debt = this_cpu_read(emulate_nvm_debt_ns) + delay_ns;
+	if (debt > 0)
+		stalled = emulate_nvm_stall_ns(min_t(u64, debt,
+					EMULATE_NVM_MAX_STALL_NS));
+
+	this_cpu_write(emulate_nvm_debt_ns, debt - stalled);
+	this_cpu_add(emulate_nvm_total_delay_ns, stalled);
+}
+
+/*
+ * Hmm, this depends on the emulating model. Anyone who even knows a little
+ * about computer architecture should know this model sucks. No modern processor
+ * would wait the entire memory read transaction, even read is on the critical
+ * path. Why I still do this? I can not tell you why. Sigh.
+ *
+ * Writes are charged separately, NVM writes are several times slower than
+ * reads while DRAM is roughly symmetric.
+ *
+ * The MLP model is what Quartz does: the time a cpu stalled on outstanding
+ * misses is what it would have lost with DRAM, so with NVM it loses that
+ * times (NVM/DRAM - 1). Misses overlapped by out-of-order execution or other
+ * misses do not show up in stall cycles, hence are not charged. It is capped
+ * by the linear model, in case stalls on L2 misses are LLC hits after all.
+ */
+static u64 counts_to_delay_ns(const struct emulate_nvm_config *cfg,
+			      u64 reads, u64 writes, u64 stall_cycles)
+{
+	u64 read_ns, stall_ns;
+
+	read_ns = reads * cfg->read_latency_delta_ns;
+
+	if (cfg->model == EMULATE_NVM_MODEL_MLP && cfg->dram_read_latency_ns) {
+		stall_ns = div_u64(stall_cycles * 1000000, cpu_khz);
+		stall_ns = div64_u64(stall_ns * cfg->read_latency_delta_ns,
+				     cfg->dram_read_latency_ns);
+		read_ns = min(read_ns, stall_ns);
+	}
+
+	return read_ns + (writes * cfg->write_latency_delta_ns);
+}
 
 /*
  * Hmm, this is the 'ultimate' emulating function. It is executed in the
- * emulating cpu core. The parameter is the nanoseconds to _waste_. You can do
+ * emulating cpu core, drains the mailbox and _wastes_ the time. You can do
  * anything in this interval... A delay function is the most lighweight one.
  * 
  * We are talking about interrupting a normal running program. But, no flush
  * overhead of cache/tlb/register are considered. It is hard to evaluate how
  * these overhead impact whole system throughput. Anyway, whatever la.
  */
-static void emulate_nvm_func(void *info)
+static void emulate_nvm_work_func(struct irq_work *work)
 {
-	u64 delay_ns = *(u64 *)info;
-	udelay(delay_ns / 1000);
+	u64 delay_ns, misses, stalls;
+
+	delay_ns = atomic64_xchg(this_cpu_ptr(&emulate_nvm_mailbox_ns), 0);
+
+	misses = this_cpu_xchg(emulate_nvm_pending_misses, 0);
+	stalls = this_cpu_xchg(emulate_nvm_pending_stalls, 0);
+	if (misses)
+		delay_ns += counts_to_delay_ns(
+				rcu_dereference_sched(emulate_nvm_config),
+				misses, 0, stalls);
+
+	emulate_nvm_charge(delay_ns);
 }
 
 /*
- * Hmm, this depends on the emulating model. Anyone who even knows a little
- * about computer architecture should know this model sucks. No modern processor
- * would wait the entire memory read transaction, even read is on the critical
- * path. Why I still do this? I can not tell you why. Sigh.
+ * Post @delay_ns to the mailbox of @cpu and return immediately. If the
+ * irq_work of @cpu is still pending, it will pick this one up as well.
+ * Must not be called on @cpu itself.
  */
-static inline u64 counts_to_delay_ns(u64 counts)
+static void emulate_nvm_post(int cpu, u64 delay_ns)
 {
-	return (counts * read_latency_delta_ns);
+	atomic64_add(delay_ns, per_cpu_ptr(&emulate_nvm_mailbox_ns, cpu));
+	irq_work_queue_on(per_cpu_ptr(&emulate_nvm_work, cpu), cpu);
+}
+
+static void emulate_nvm_init_work(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		atomic64_set(per_cpu_ptr(&emulate_nvm_mailbox_ns, cpu), 0);
+		init_irq_work(per_cpu_ptr(&emulate_nvm_work, cpu),
+			      emulate_nvm_work_func);
+	}
+}
+
+static void emulate_nvm_sync_work(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		irq_work_sync(per_cpu_ptr(&emulate_nvm_work, cpu));
+}
+
+/*
+ * Local mode injection engine. The overflow NMI can not afford a long delay,
+ * so it just accumulates misses and raises a self irq_work. The irq_work runs
+ * on the very same cpu as soon as NMI returns, and wastes time there. Nothing
+ * goes through the polling cpu or the interconnect.
+ */
+static void emulate_nvm_overflow(u64 misses, u64 stall_cycles)
+{
+	struct emulate_nvm_config *cfg;
+
+	cfg = rcu_dereference_sched(emulate_nvm_config);
+	if (cfg->mode != EMULATE_NVM_MODE_LOCAL)
+		return;
+
+	if (!cpumask_test_cpu(smp_processor_id(), &cfg->cpus))
+		return;
+
+	this_cpu_add(emulate_nvm_pending_misses, misses);
+	this_cpu_add(emulate_nvm_pending_stalls, stall_cycles);
+	irq_work_queue(this_cpu_ptr(&emulate_nvm_work));
+}
+
+static int start_emulate_local(void)
+{
+	int ret;
+
+	ret = core_pmu_register_overflow_handler(emulate_nvm_overflow);
+	if (ret)
+		return ret;
+
+	overflow_handler_registed = true;
+	return 0;
+}
+
+static void finish_emulate_local(void)
+{
+	if (overflow_handler_registed) {
+		core_pmu_unregister_overflow_handler();
+		overflow_handler_registed = false;
+	}
 }
 
 extern u64 proc_counts;
+extern u64 proc_write_counts;
+extern u64 proc_imc_counts;
+
+/*
+ * Busy phases get short epochs, so stalls are spread across the interval
+ * instead of landing as one big chunk. Idle phases get long epochs, to cut
+ * polling overhead. The duration changes at most 2x per epoch to damp noise.
+ */
+static u64 emulate_nvm_adapt_epoch(const struct emulate_nvm_config *cfg,
+				   u64 duration, u64 counts)
+{
+	u64 next;
+
+	if (!cfg->epoch_target)
+		return cfg->epoch_ns;
+
+	if (counts)
+		next = div64_u64(duration * cfg->epoch_target, counts);
+	else
+		next = duration * 2;
+
+	next = clamp(next, duration / 2, duration * 2);
+	next = clamp(next, cfg->epoch_min_ns, cfg->epoch_max_ns);
+
+	return next;
+}
+
+/* Stall cycles of @cpu since last epoch */
+static u64 emulate_nvm_stall_delta(int cpu)
+{
+	u64 stalls, last;
+
+	stalls = core_pmu_stall_cycles(cpu);
+	last = per_cpu(emulate_nvm_last_stalls, cpu);
+	per_cpu(emulate_nvm_last_stalls, cpu) = stalls;
+
+	return stalls - last;
+}
+
+/* Whether pollers charge @cpu under @cfg */
+static bool emulate_nvm_polled(const struct emulate_nvm_config *cfg, int cpu)
+{
+	if (cfg->mode == EMULATE_NVM_MODE_HA)
+		return cpu == cfg->emulate_nvm_cpu;
+	if (cfg->mode == EMULATE_NVM_MODE_PERCPU)
+		return cpumask_test_cpu(cpu, &cfg->cpus);
+	return false;
+}
+
+/* Take @now as the new @last, return the difference */
+static inline u64 emulate_nvm_delta(u64 *last, u64 now)
+{
+	u64 delta = now - *last;
+
+	*last = now;
+	return delta;
+}
+
+/*
+ * Time @writes take beyond @duration at the write bandwidth ceiling. If
+ * every writer stalls this long, all of them together write no faster
+ * than the ceiling. Reads are left to the IMC throttling of uncore.
+ */
+static u64 emulate_nvm_write_over(const struct emulate_nvm_config *cfg,
+				  u64 writes, u64 duration)
+{
+	u64 ns;
+
+	if (!cfg->nvm_write_bw_mbps)
+		return 0;
+
+	ns = div64_u64(writes * EMULATE_NVM_LINE_BYTES * 1000,
+		       cfg->nvm_write_bw_mbps);
+	return ns > duration ? ns - duration : 0;
+}
+
+/*
+ * Walk through emulated cpus of sockets served by @p, translate counts of
+ * last epoch into delay of each cpu, and then post it to them. Return the
+ * delay posted to all cpus.
+ *
+ * HA mode: NVM accesses published by the master since last time all go to
+ * emulate_nvm_cpu. Per-CPU mode: LLC misses of each cpu, read on its own
+ * socket. Core PMU can not tell writebacks of each cpu, so NVM writes are
+ * shared in proportion to misses, of all sockets. Time over the write
+ * ceiling is charged in full to every cpu which got a share of writes,
+ * and time over the software bandwidth limit to every cpu which missed.
+ *
+ * Cpus which @p starts to charge are charged from now on, not since the
+ * last time they were polled.
+ */
+static u64 emulate_nvm_poller_charge(struct emulate_nvm_poller *p,
+				     const struct emulate_nvm_config *cfg)
+{
+	u64 reads, writes, over, bw_over, all, misses, last, stalls, delay_ns;
+	u64 share;
+	u64 local = 0, posted = 0;
+	unsigned int node, i;
+	int cpu;
+
+	reads = emulate_nvm_delta(&p->last_reads, READ_ONCE(emulate_nvm_nvm_reads));
+	writes = emulate_nvm_delta(&p->last_writes, READ_ONCE(emulate_nvm_nvm_writes));
+	over = emulate_nvm_delta(&p->last_write_over,
+				 READ_ONCE(emulate_nvm_write_over_ns));
+	bw_over = emulate_nvm_delta(&p->last_bw_over,
+				    READ_ONCE(emulate_nvm_bw_over_ns));
+
+	for_each_node_mask(node, p->served) {
+		for_each_cpu(cpu, cpumask_of_node(node)) {
+			if (!emulate_nvm_polled(cfg, cpu)) {
+				per_cpu(emulate_nvm_charged, cpu) = false;
+				continue;
+			}
+
+			misses = core_pmu_llc_misses(cpu);
+			if (!per_cpu(emulate_nvm_charged, cpu)) {
+				per_cpu(emulate_nvm_last_misses, cpu) = misses;
+				per_cpu(emulate_nvm_last_stalls, cpu) =
+					core_pmu_stall_cycles(cpu);
+				per_cpu(emulate_nvm_charged, cpu) = true;
+			}
+
+			last = per_cpu(emulate_nvm_last_misses, cpu);
+			per_cpu(emulate_nvm_last_misses, cpu) = misses;
+			per_cpu(emulate_nvm_epoch_misses, cpu) = misses - last;
+			local += misses - last;
+		}
+	}
+	WRITE_ONCE(p->misses, p->misses + local);
+
+	/* Misses of all sockets since last time, ours included */
+	all = READ_ONCE(emulate_nvm_master->misses);
+	for (i = 0; i < UNCORE_MAX_SOCKET; i++) {
+		if (emulate_nvm_helpers[i])
+			all += READ_ONCE(emulate_nvm_helpers[i]->misses);
+	}
+	all = emulate_nvm_delta(&p->last_all_misses, all);
+
+	for_each_node_mask(node, p->served) {
+		for_each_cpu(cpu, cpumask_of_node(node)) {
+			if (!per_cpu(emulate_nvm_charged, cpu))
+				continue;
+
+			stalls = emulate_nvm_stall_delta(cpu);
+			if (cfg->mode == EMULATE_NVM_MODE_HA) {
+				delay_ns = counts_to_delay_ns(cfg, reads, writes,
+							      stalls) + over + bw_over;
+			} else {
+				misses = per_cpu(emulate_nvm_epoch_misses, cpu);
+				share = all ? div64_u64(writes * misses, all) : 0;
+				delay_ns = counts_to_delay_ns(cfg, misses, share,
+							      stalls);
+				if (share)
+					delay_ns += over;
+				if (misses)
+					delay_ns += bw_over;
+			}
+			emulate_nvm_post(cpu, delay_ns);
+			posted += delay_ns;
+		}
+	}
+
+	return posted;
+}
+
+static void emulate_nvm_free_config(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct emulate_nvm_config, rcu));
+}
+
+/*
+ * Swap in the config published during last epoch, if any. Must run on the
+ * master, or with its hrtimer stopped.
+ */
+static struct emulate_nvm_config *emulate_nvm_swap_config(void)
+{
+	struct emulate_nvm_config *old, *new;
+
+	old = rcu_dereference_protected(emulate_nvm_config, 1);
+	new = xchg(&emulate_nvm_next_config, NULL);
+	if (!new)
+		return old;
+
+	rcu_assign_pointer(emulate_nvm_config, new);
+	call_rcu_sched(&old->rcu, emulate_nvm_free_config);
+	return new;
+}
+
+/*
+ * Tell ring consumers what values of coming records are: every bound event
+ * of the snapshot, then the delay posted this epoch. Call it whenever the
+ * snapshot or its events change.
+ */
+static void emulate_nvm_ring_layout(struct emulate_nvm_poller *p)
+{
+	struct uncore_snapshot *snap = &p->snapshot;
+	const char *names[UNCORE_RING_MAX_VALUES];
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < snap->nr_boxes; i++) {
+		for (j = 0; j < UNCORE_BOX_MAX_EVENTS; j++) {
+			if (!snap->boxes[i]->events[j])
+				continue;
+			if (n == UNCORE_RING_MAX_VALUES - 1)
+				goto out;
+			names[n++] = snap->boxes[i]->events[j]->name;
+		}
+	}
+out:
+	names[n++] = "delay_ns";
+	uncore_ring_set_layout(snap->nodeid, names, n);
+}
+
+/* Append counts of last epoch, laid out as emulate_nvm_ring_layout says */
+static void emulate_nvm_ring_sample(struct emulate_nvm_poller *p, u64 delay_ns)
+{
+	struct uncore_snapshot *snap = &p->snapshot;
+	u64 values[UNCORE_RING_MAX_VALUES];
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < snap->nr_boxes; i++) {
+		for (j = 0; j < UNCORE_BOX_MAX_EVENTS; j++) {
+			if (!snap->boxes[i]->events[j])
+				continue;
+			if (n == UNCORE_RING_MAX_VALUES - 1)
+				goto out;
+			values[n++] = snap->values[i][j];
+		}
+	}
+out:
+	values[n++] = delay_ns;
+	uncore_ring_write(snap->nodeid, p->duration, values, n);
+}
 
 static enum hrtimer_restart emulate_nvm_hrtimer(struct hrtimer *hrtimer)
 {
-	struct uncore_box *box;
-	u64 counts, delay_ns;
+	struct emulate_nvm_poller *p;
+	struct emulate_nvm_config *cfg, *old;
+	u64 *values;
+	u64 counts = 0, write_counts = 0, delay_ns;
 	
-	box = container_of(hrtimer, struct uncore_box, hrtimer);
+	p = container_of(hrtimer, struct emulate_nvm_poller, hrtimer);
+	cfg = rcu_dereference_sched(emulate_nvm_config);
 	
 	/*
 	 * Step I:
-	 * a) Freeze counter
-	 * b) Read counter
+	 * Snapshot all bound boxes of our socket, take counts since last epoch.
+	 * Master publishes counts of the HA box of NVM node. Boxes are collected
+	 * again if event groups changed, e.g. the IMC controller took some.
 	 */
-	uncore_disable_box(box);
-	uncore_read_counter(box, &counts);
-	proc_counts = counts;
+	if (uncore_snapshot_changed(&p->snapshot)) {
+		uncore_snapshot_init(&p->snapshot, p->nodeid);
+		emulate_nvm_ring_layout(p);
+	}
+	uncore_snapshot_read(&p->snapshot);
+	if (p == emulate_nvm_master) {
+		values = uncore_snapshot_values(&p->snapshot, HA_Box_NVM);
+		if (values) {
+			counts = values[read_ctr];
+			write_counts = values[write_ctr];
+			proc_imc_counts = values[imc_read_ctr];
+		}
+		proc_counts = counts;
+		proc_write_counts = write_counts;
+
+		WRITE_ONCE(emulate_nvm_nvm_reads, emulate_nvm_nvm_reads + counts);
+		WRITE_ONCE(emulate_nvm_nvm_writes,
+			   emulate_nvm_nvm_writes + write_counts);
+		WRITE_ONCE(emulate_nvm_write_over_ns, emulate_nvm_write_over_ns +
+			   emulate_nvm_write_over(cfg, write_counts, p->duration));
+		WRITE_ONCE(emulate_nvm_bw_over_ns, emulate_nvm_bw_over_ns +
+			   uncore_imc_charge(HA_Box_NVM->nodeid,
+				(counts + write_counts) * EMULATE_NVM_LINE_BYTES));
+	}
 
 	/*
 	 * Step II:
 	 * a) Translate counts to real additional delay
-	 * b) Send delay function to remote emulating cpu
+	 * b) Post delay to emulated cpus of our sockets, do not wait
 	 */
-	delay_ns = counts_to_delay_ns(counts);
-	smp_call_function_single(emulate_nvm_cpu, emulate_nvm_func, &delay_ns, 1);
+	delay_ns = emulate_nvm_poller_charge(p, cfg);
+	emulate_nvm_ring_sample(p, delay_ns);
 
 	#ifdef verbose
-	pr_info("on cpu %d, delay_ns=%llu, udelay=%llu", smp_processor_id(), delay_ns,
-			delay_ns/1000);
-	uncore_show_box(box);
+	pr_info("on cpu %d, delay_ns=%llu", smp_processor_id(), delay_ns);
 	#endif
 
-	/*
-	 * Step III:
-	 * a) Clear counter
-	 * b) Enable counting
-	 */
-	uncore_write_counter(box, 0);
-	uncore_enable_box(box);
+	if (p != emulate_nvm_master) {
+		p->duration = READ_ONCE(emulate_nvm_epoch_ns);
+		goto out;
+	}
 
 	hrtimer_jiffies++;
 
-	hrtimer_forward_now(hrtimer, ns_to_ktime(box->hrtimer_duration));
+	/*
+	 * Step III, master only:
+	 * a) Swap in new parameters, if any
+	 * b) Switch counting events, if asked
+	 * c) Choose length of next epoch
+	 */
+	old = cfg;
+	cfg = emulate_nvm_swap_config();
+	if (cfg->read_event != old->read_event)
+		uncore_box_replace_event(HA_Box_NVM, read_ctr, cfg->read_event);
+	if (cfg->write_event != old->write_event)
+		uncore_box_replace_event(HA_Box_NVM, write_ctr, cfg->write_event);
+	p->duration = emulate_nvm_adapt_epoch(cfg, p->duration,
+					      counts + write_counts);
+	WRITE_ONCE(emulate_nvm_epoch_ns, p->duration);
+
+out:
+	hrtimer_forward_now(hrtimer, ns_to_ktime(p->duration));
 	return HRTIMER_RESTART;
 }
 
+static void emulate_nvm_start_poller(void *info)
+{
+	struct emulate_nvm_poller *p = info;
+
+	p->cpu = smp_processor_id();
+	hrtimer_start(&p->hrtimer, ns_to_ktime(p->duration),
+		      HRTIMER_MODE_REL_PINNED);
+}
+
+/*
+ * Choose a cpu for each socket other than those of NVM node and polling
+ * cpu, one which is not emulated. Do it before platform preparation, so
+ * they stay online.
+ */
+static void emulate_nvm_place_pollers(const struct emulate_nvm_config *cfg)
+{
+	unsigned int node;
+	int cpu;
+
+	cpumask_clear(&emulate_nvm_helper_cpus);
+	if (!socket_pollers)
+		return;
+
+	for_each_online_node(node) {
+		if (node >= UNCORE_MAX_SOCKET || node == nvm_node ||
+		    node == cpu_to_node(cfg->polling_cpu))
+			continue;
+
+		for_each_cpu(cpu, cpumask_of_node(node)) {
+			if (cpu == cfg->emulate_nvm_cpu ||
+			    cpumask_test_cpu(cpu, &cfg->cpus))
+				continue;
+			cpumask_set_cpu(cpu, &emulate_nvm_helper_cpus);
+			break;
+		}
+	}
+}
+
+static struct emulate_nvm_poller *emulate_nvm_new_poller(unsigned int nodeid,
+							 unsigned int cpu)
+{
+	struct emulate_nvm_poller *p;
+
+	p = kzalloc_node(sizeof(*p), GFP_KERNEL, cpu_to_node(cpu));
+	if (!p)
+		return NULL;
+
+	if (uncore_snapshot_init(&p->snapshot, nodeid)) {
+		kfree(p);
+		return NULL;
+	}
+
+	hrtimer_init(&p->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	p->hrtimer.function = emulate_nvm_hrtimer;
+	p->cpu = cpu;
+	p->nodeid = nodeid;
+	p->duration = emulate_nvm_epoch_ns;
+	emulate_nvm_ring_layout(p);
+
+	return p;
+}
+
+static void emulate_nvm_free_pollers(void)
+{
+	unsigned int node;
+
+	for (node = 0; node < UNCORE_MAX_SOCKET; node++) {
+		kfree(emulate_nvm_helpers[node]);
+		emulate_nvm_helpers[node] = NULL;
+	}
+	kfree(emulate_nvm_master);
+	emulate_nvm_master = NULL;
+}
+
+/*
+ * Master polls the NVM node from the polling cpu, and serves every socket
+ * without a poller of its own. Event group of NVM node must be bound.
+ */
+static int emulate_nvm_create_pollers(const struct emulate_nvm_config *cfg)
+{
+	unsigned int node;
+	int cpu;
+
+	emulate_nvm_master = emulate_nvm_new_poller(nvm_node, cfg->polling_cpu);
+	if (!emulate_nvm_master)
+		goto fail;
+	nodes_clear(emulate_nvm_master->served);
+
+	for_each_online_node(node) {
+		if (node >= UNCORE_MAX_SOCKET)
+			break;
+
+		cpu = cpumask_first_and(&emulate_nvm_helper_cpus,
+					cpumask_of_node(node));
+		if (cpu >= nr_cpu_ids) {
+			node_set(node, emulate_nvm_master->served);
+			continue;
+		}
+
+		emulate_nvm_helpers[node] = emulate_nvm_new_poller(node, cpu);
+		if (!emulate_nvm_helpers[node])
+			goto fail;
+		node_set(node, emulate_nvm_helpers[node]->served);
+	}
+
+	return 0;
+
+fail:
+	emulate_nvm_free_pollers();
+	return -ENOMEM;
+}
+
+static void emulate_nvm_start_pollers(void)
+{
+	unsigned int node;
+
+	smp_call_function_single(emulate_nvm_master->cpu,
+				 emulate_nvm_start_poller, emulate_nvm_master, 1);
+
+	for (node = 0; node < UNCORE_MAX_SOCKET; node++) {
+		if (emulate_nvm_helpers[node])
+			smp_call_function_single(emulate_nvm_helpers[node]->cpu,
+				emulate_nvm_start_poller, emulate_nvm_helpers[node], 1);
+	}
+}
+
+static void emulate_nvm_cancel_pollers(void)
+{
+	unsigned int node;
+
+	hrtimer_cancel(&emulate_nvm_master->hrtimer);
+	for (node = 0; node < UNCORE_MAX_SOCKET; node++) {
+		if (emulate_nvm_helpers[node])
+			hrtimer_cancel(&emulate_nvm_helpers[node]->hrtimer);
+	}
+}
+
 static int start_emulate_latency(void)
 {
+	int ret;
+
 	/*
-	 * Home Agent: (Box0, Node0), (Box0, Node1)
+	 * Home Agent: (Box0, NVM Node)
 	 */
-	HA_Box_0 = uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], 0);
-	HA_Box_1 = uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], 1);
-	if (!HA_Box_0 || !HA_Box_1) {
-		pr_err("Get HA Box Failed");
+	HA_Box_NVM = uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], nvm_node);
+	if (!HA_Box_NVM) {
+		pr_err("Get HA Box of Node %u Failed", nvm_node);
 		return -ENXIO;
 	}
 	
-	event = &ha_requests_remote_reads;
-	uncore_box_bind_event(HA_Box_1, event);
-
 	/*
 	 * a) Init and reset box
 	 * b) Freeze counter
-	 * c) Set and enable event
+	 * c) Add the event group, each event gets its own counter
 	 * d) Un-Freeze, start counting
 	 */
-	uncore_init_box(HA_Box_1);
-	uncore_disable_box(HA_Box_1);
-	uncore_enable_event(HA_Box_1, event);
-	uncore_enable_box(HA_Box_1);
-	
+	uncore_init_box(HA_Box_NVM);
+	uncore_disable_box(HA_Box_NVM);
+
+	read_ctr = uncore_box_add_event(HA_Box_NVM,
+			emulate_nvm_shadow_config.read_event);
+	write_ctr = uncore_box_add_event(HA_Box_NVM,
+			emulate_nvm_shadow_config.write_event);
+	imc_read_ctr = uncore_box_add_event(HA_Box_NVM,
+			uncore_catalog_find(EMULATE_NVM_IMC_READ_EVENT));
+	if (read_ctr < 0 || write_ctr < 0 || imc_read_ctr < 0) {
+		pr_err("Add HA Events Failed");
+		uncore_clear_box(HA_Box_NVM);
+		return -ENOSPC;
+	}
+
+	uncore_enable_box(HA_Box_NVM);
+
 	/*
 	 * In emulating latency part, the most important thing
-	 * is replacing the original hrtimer function. The original 
-	 * one just collect counts and in case counter overflows.
+	 * is our own hrtimer function on every socket. The box
+	 * hrtimer just collect counts and in case counter overflows.
 	 * But here, we rely on our hrtimer function to send IPI
 	 * to the emulating core, to emulate the slow read latency
 	 * of NVM. Not so hard, huh?
 	 */
-	uncore_box_change_hrtimer(HA_Box_1, emulate_nvm_hrtimer);
-	uncore_box_change_duration(HA_Box_1, emulate_nvm_hrtimer_duration_ns);
-	uncore_box_start_hrtimer(HA_Box_1);
+	emulate_nvm_epoch_ns = emulate_nvm_shadow_config.epoch_ns;
+	ret = emulate_nvm_create_pollers(&emulate_nvm_shadow_config);
+	if (ret) {
+		pr_err("Create Pollers Failed");
+		uncore_clear_box(HA_Box_NVM);
+		return ret;
+	}
+
+	emulate_nvm_init_work();
+
+	/* Local mode does not need polling, it hooks into core.ko */
+	ret = start_emulate_local();
+	if (ret) {
+		emulate_nvm_free_pollers();
+		uncore_clear_box(HA_Box_NVM);
+		return ret;
+	}
+
+	emulate_nvm_start_pollers();
 
 	latency_started = true;
 
@@ -170,20 +908,20 @@ static int start_emulate_latency(void)
 static void finish_emulate_latency(void)
 {
 	if (latency_started) {
-		/* cancel hrtimer */
-		uncore_box_cancel_hrtimer(HA_Box_0);
-		uncore_box_cancel_hrtimer(HA_Box_1);
+		finish_emulate_local();
+
+		/* cancel hrtimers */
+		emulate_nvm_cancel_pollers();
+		emulate_nvm_sync_work();
+		emulate_nvm_free_pollers();
 
 		/* show some information, if you wanna */
-		uncore_disable_box(HA_Box_0);
-		uncore_show_box(HA_Box_0);
-		uncore_disable_box(HA_Box_1);
-		uncore_show_box(HA_Box_1);
+		uncore_disable_box(HA_Box_NVM);
+		uncore_show_box(HA_Box_NVM);
 		uncore_print_global_pmu(&uncore_pmu);
 
-		/* clear these boxes and exit */
-		uncore_clear_box(HA_Box_0);
-		uncore_clear_box(HA_Box_1);
+		/* clear the box and exit */
+		uncore_clear_box(HA_Box_NVM);
 
 		latency_started = false;
 	}
@@ -206,47 +944,89 @@ static void finish_emulate_bandwidth(void)
 	uncore_imc_disable_throttle_all();
 }
 
-void show_emulate_parameter(void)
+void show_emulate_parameter(const struct emulate_nvm_config *cfg)
 {
 	pr_info("------------------------ Emulation Parameters ----------------------");
-	pr_info("Hrtimer Duration: %llu ns (%llu ms)\n", emulate_nvm_hrtimer_duration_ns,
-		emulate_nvm_hrtimer_duration_ns/1000000);
-	pr_info("Polling CPU:  CPU%2d (Node %2d)", polling_cpu, polling_node);
-	pr_info("Emulated CPU: CPU%2d (Node %2d)", emulate_nvm_cpu, emulate_nvm_node);
+	pr_info("Hrtimer Duration: %llu ns (%llu ms)\n", cfg->epoch_ns,
+		cfg->epoch_ns/1000000);
+	if (cfg->epoch_target)
+		pr_info("Adaptive Epoch: [%llu, %llu] ns, %llu counts per epoch",
+			cfg->epoch_min_ns, cfg->epoch_max_ns, cfg->epoch_target);
+	pr_info("Polling CPU:  CPU%2d (Node %2d)", cfg->polling_cpu,
+		cpu_to_node(cfg->polling_cpu));
+	if (cfg->mode == EMULATE_NVM_MODE_PERCPU)
+		pr_info("Emulated CPU: %*pbl (Per-CPU)", cpumask_pr_args(&cfg->cpus));
+	else if (cfg->mode == EMULATE_NVM_MODE_LOCAL)
+		pr_info("Emulated CPU: %*pbl (Local)", cpumask_pr_args(&cfg->cpus));
+	else
+		pr_info("Emulated CPU: CPU%2d (Node %2d)", cfg->emulate_nvm_cpu,
+			cpu_to_node(cfg->emulate_nvm_cpu));
 	
-	pr_info("Latency Model:");
-	pr_info("\t---------------------");
-	pr_info("\t|_______| Read (ns) |");
-	pr_info("\t| NVM   |    %3llu    |", nvm_read_latency_ns);
-	pr_info("\t| DRAM  |    %3llu    |", dram_read_latency_ns);
-	pr_info("\t| Delta |    %3llu    |", read_latency_delta_ns);
-	pr_info("\t---------------------");
+	pr_info("Latency Model: %s",
+		cfg->model == EMULATE_NVM_MODEL_MLP ? "MLP" : "Linear");
+	pr_info("\t---------------------------------");
+	pr_info("\t|_______| Read (ns) | Write (ns) |");
+	pr_info("\t| NVM   |    %3llu    |    %4llu    |",
+		cfg->nvm_read_latency_ns, cfg->nvm_write_latency_ns);
+	pr_info("\t| DRAM  |    %3llu    |    %4llu    |",
+		cfg->dram_read_latency_ns, cfg->dram_write_latency_ns);
+	pr_info("\t| Delta |    %3llu    |    %4llu    |",
+		cfg->read_latency_delta_ns, cfg->write_latency_delta_ns);
+	pr_info("\t---------------------------------");
+	if (cfg->nvm_write_bw_mbps)
+		pr_info("Write Bandwidth Ceiling: %llu MB/s", cfg->nvm_write_bw_mbps);
 	pr_info("------------------------ Emulation Parameters ----------------------");
 }
 
-static int prepare_platform_configuration(void)
+static int prepare_platform_configuration(const struct emulate_nvm_config *cfg)
 {
 	int cpu;
 	const struct cpumask *mask;
 	
 	cpu = smp_processor_id();
-	if (cpu != polling_cpu) {
+	if (cpu != cfg->polling_cpu) {
 		printk(KERN_CONT "ERROR: current CPU:%2d is not polling CPU:%2d... ",
-			cpu, polling_cpu);
+			cpu, cfg->polling_cpu);
 		return -1;
 	}
 
+	cpumask_clear(&offlined_cpus);
+
+	/* Simulated boxes count nothing real, leave the machine alone */
+	if (uncore_simulate)
+		return 0;
+
+	/*
+	 * Per-core OFFCORE_RESPONSE counting tells which core went to the
+	 * NVM node, nobody has to be taken down for that.
+	 */
+	if (!offline_cpus) {
+		saved_core_pmu_source = core_pmu_source;
+		core_pmu_source_saved = true;
+		return core_pmu_set_source(CORE_PMU_SOURCE_REMOTE_DRAM);
+	}
+
 	/*
  	 * In hybrid-memory configuration model, CPUs except the
 	 * emulating one must be offlined. We have to do this because
 	 * the 'ha_requests_remote_reads' event can _not_ distinguish
 	 * requests from different cpus. To gain a 'best' emulation model,
 	 * only the emulating cpu can alive!
+	 *
+	 * In Per-CPU mode, emulated cpus are charged by their own misses,
+	 * so all of them stay alive. Socket pollers stay as well, they only
+	 * touch their own socket.
  	 */
-	mask = cpumask_of_node(emulate_nvm_node);
+	mask = cpumask_of_node(cpu_to_node(cfg->emulate_nvm_cpu));
 	for_each_cpu(cpu, mask) {
-		if (cpu != emulate_nvm_cpu)
-			cpu_down(cpu);
+		if (cpu == cfg->emulate_nvm_cpu ||
+		    cpumask_test_cpu(cpu, &emulate_nvm_helper_cpus))
+			continue;
+		if (cfg->mode == EMULATE_NVM_MODE_PERCPU &&
+		    cpumask_test_cpu(cpu, &cfg->cpus))
+			continue;
+		if (!cpu_down(cpu))
+			cpumask_set_cpu(cpu, &offlined_cpus);
 	}
 
 	/*
@@ -254,48 +1034,225 @@ static int prepare_platform_configuration(void)
 	 * except the polling cpu should be offlined, too. It is OK if
 	 * they are still online, however...
 	 */
-	mask = cpumask_of_node(polling_node);
+	mask = cpumask_of_node(cpu_to_node(cfg->polling_cpu));
 	for_each_cpu(cpu, mask) {
-		if (cpu != polling_cpu)
-			cpu_down(cpu);
+		if (cpu == cfg->polling_cpu ||
+		    cpumask_test_cpu(cpu, &emulate_nvm_helper_cpus))
+			continue;
+		if (!cpu_down(cpu))
+			cpumask_set_cpu(cpu, &offlined_cpus);
 	}
 
 	return 0;
 }
 
+/*
+ * Note that cpumask_of_node only includes online cpus, so we have to
+ * remember which cpus were taken down by prepare_platform_configuration.
+ */
 static void restore_platform_configuration(void)
 {
 	int cpu;
-	const struct cpumask *mask;
 
-	mask = cpumask_of_node(emulate_nvm_node);
-	for_each_cpu_not(cpu, mask) {
-		if (cpu != emulate_nvm_cpu)
-			cpu_up(cpu);
+	if (core_pmu_source_saved) {
+		core_pmu_set_source(saved_core_pmu_source);
+		core_pmu_source_saved = false;
 	}
-	
-	mask = cpumask_of_node(polling_node);
-	for_each_cpu(cpu, mask) {
-		if (cpu != polling_cpu)
-			cpu_up(cpu);
+
+	for_each_cpu(cpu, &offlined_cpus) {
+		if (!cpu_up(cpu))
+			cpumask_clear_cpu(cpu, &offlined_cpus);
 	}
 }
 
-#define pr_fail		printk(KERN_CONT "\033[31m fail \033[0m")
-#define pr_okay		printk(KERN_CONT "\033[32m okay \033[0m")
+/* Bring @cpu back if it was taken down by platform preparation */
+static int emulate_nvm_online_cpu(unsigned int cpu)
+{
+	if (cpumask_test_cpu(cpu, &offlined_cpus) && !cpu_up(cpu))
+		cpumask_clear_cpu(cpu, &offlined_cpus);
 
-#define PR_RESULT()	(ret)? pr_fail: pr_okay
+	return cpu_online(cpu) ? 0 : -ENXIO;
+}
 
-void start_emulate_nvm(void)
+/* Master hrtimer is stopped, restart it on the new polling cpu */
+static void emulate_nvm_move_hrtimer(void *info)
 {
-	int ret;
+	emulate_nvm_swap_config();
+	emulate_nvm_start_poller(emulate_nvm_master);
+}
+
+static int emulate_nvm_check_config(const struct emulate_nvm_config *cfg)
+{
+	if (cfg->model >= EMULATE_NVM_MODEL_MAX ||
+	    cfg->mode >= EMULATE_NVM_MODE_MAX)
+		return -EINVAL;
+
+	/* Per-CPU and Local mode need emulated cpus */
+	if (cfg->mode != EMULATE_NVM_MODE_HA && cpumask_empty(&cfg->cpus))
+		return -EINVAL;
+
+	if (cfg->nvm_read_latency_ns < cfg->dram_read_latency_ns ||
+	    cfg->nvm_write_latency_ns < cfg->dram_write_latency_ns)
+		return -EINVAL;
+
+	if (cfg->epoch_ns < EMULATE_NVM_MIN_EPOCH_NS ||
+	    cfg->epoch_min_ns < EMULATE_NVM_MIN_EPOCH_NS ||
+	    cfg->epoch_min_ns > cfg->epoch_max_ns)
+		return -EINVAL;
+
+	/* Events are switched in place, counters must be able to count them */
+	if (!cfg->read_event || !cfg->write_event ||
+	    (cfg->read_event->counters &&
+	     !(cfg->read_event->counters & (1U << read_ctr))) ||
+	    (cfg->write_event->counters &&
+	     !(cfg->write_event->counters & (1U << write_ctr))))
+		return -EINVAL;
+
+	/* Polling cpus post delay, they can not be charged themselves */
+	if (cfg->polling_cpu >= nr_cpu_ids ||
+	    cfg->emulate_nvm_cpu >= nr_cpu_ids ||
+	    cfg->polling_cpu == cfg->emulate_nvm_cpu ||
+	    cpumask_test_cpu(cfg->polling_cpu, &cfg->cpus) ||
+	    cpumask_test_cpu(cfg->polling_cpu, &emulate_nvm_helper_cpus) ||
+	    cpumask_test_cpu(cfg->emulate_nvm_cpu, &emulate_nvm_helper_cpus) ||
+	    cpumask_intersects(&cfg->cpus, &emulate_nvm_helper_cpus))
+		return -EINVAL;
+
+	/*
+	 * The master reads the HA box of NVM node, not across QPI. Simulated
+	 * nodes may not exist, any cpu polls them equally well.
+	 */
+	if (!uncore_simulate && cpu_to_node(cfg->polling_cpu) != nvm_node)
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * emulate_nvm_get_config
+ * @cfg:	where to copy the config to
+ *
+ * Copy the latest config asked for, which may not be in effect yet.
+ * Modify it and pass it to emulate_nvm_set_config.
+ */
+void emulate_nvm_get_config(struct emulate_nvm_config *cfg)
+{
+	mutex_lock(&emulate_nvm_config_mutex);
+	*cfg = emulate_nvm_shadow_config;
+	mutex_unlock(&emulate_nvm_config_mutex);
+}
+
+/**
+ * emulate_nvm_polling_cpus
+ * @mask:	where to put the cpus
+ *
+ * Cpus polling uncore for the emulator, the polling cpu and socket helpers.
+ * Nothing else should run there, see uncore_imc_calib.c. Empty if emulation
+ * is not running.
+ */
+void emulate_nvm_polling_cpus(struct cpumask *mask)
+{
+	cpumask_clear(mask);
+
+	mutex_lock(&emulate_nvm_config_mutex);
+	if (emulation_started) {
+		cpumask_copy(mask, &emulate_nvm_helper_cpus);
+		cpumask_set_cpu(emulate_nvm_shadow_config.polling_cpu, mask);
+	}
+	mutex_unlock(&emulate_nvm_config_mutex);
+}
+
+/**
+ * emulate_nvm_set_config
+ * @cfg:	the new parameters, latency deltas are derived
+ * Return:	0 on success
+ *
+ * Publish a copy of @cfg, which the polling cpu swaps in at the next epoch
+ * boundary, so the epoch in flight is charged with the parameters it ran
+ * with. hrtimer keeps running, unless the polling cpu changes: hrtimer is
+ * bound to cpu, it is stopped and restarted on the new polling cpu then.
+ * Cpus which were offlined during platform preparation are brought back
+ * when the new config needs them.
+ */
+int emulate_nvm_set_config(const struct emulate_nvm_config *cfg)
+{
+	struct emulate_nvm_config *new;
+	unsigned int old_polling_cpu;
+	int cpu, ret;
+
+	ret = emulate_nvm_check_config(cfg);
+	if (ret)
+		return ret;
+
+	new = kmemdup(cfg, sizeof(*cfg), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	new->read_latency_delta_ns =
+		new->nvm_read_latency_ns - new->dram_read_latency_ns;
+	new->write_latency_delta_ns =
+		new->nvm_write_latency_ns - new->dram_write_latency_ns;
+
+	mutex_lock(&emulate_nvm_config_mutex);
+	if (!emulation_started) {
+		ret = -EPERM;
+		goto out;
+	}
+
+	ret = emulate_nvm_online_cpu(new->polling_cpu);
+	if (!ret)
+		ret = emulate_nvm_online_cpu(new->emulate_nvm_cpu);
+	for_each_cpu(cpu, &new->cpus) {
+		if (ret)
+			break;
+		ret = emulate_nvm_online_cpu(cpu);
+	}
+	if (ret)
+		goto out;
+
+	show_emulate_parameter(new);
+
+	/* Once published, @new belongs to the polling cpu */
+	old_polling_cpu = emulate_nvm_shadow_config.polling_cpu;
+	emulate_nvm_shadow_config = *new;
+
+	/* A config which was never swapped in has no readers */
+	kfree(xchg(&emulate_nvm_next_config, new));
+	new = NULL;
+
+	if (emulate_nvm_shadow_config.polling_cpu != old_polling_cpu) {
+		hrtimer_cancel(&emulate_nvm_master->hrtimer);
+		ret = smp_call_function_single(emulate_nvm_shadow_config.polling_cpu,
+					       emulate_nvm_move_hrtimer, NULL, 1);
+	}
+
+out:
+	mutex_unlock(&emulate_nvm_config_mutex);
+	kfree(new);
+	return ret;
+}
+
+static int emulate_nvm_init_config(void)
+{
+	struct emulate_nvm_config *cfg;
+	int cpu;
+
+	cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return -ENOMEM;
 
 	/*
 	 * Memory Latency Model
 	 */
-	dram_read_latency_ns  = 100;
-	nvm_read_latency_ns   = 300;
-	read_latency_delta_ns = 200;
+	cfg->dram_read_latency_ns  = 100;
+	cfg->nvm_read_latency_ns   = 300;
+	cfg->read_latency_delta_ns = 200;
+
+	cfg->dram_write_latency_ns  = 100;
+	cfg->nvm_write_latency_ns   = 1000;
+	cfg->write_latency_delta_ns = 900;
+
+	cfg->model = EMULATE_NVM_MODEL_LINEAR;
 
 	/*
 	 * Polling CPU is the one always polling uncore pmu
@@ -303,29 +1260,123 @@ void start_emulate_nvm(void)
 	 *
 	 * Emulate NVM CPU is the one used to emulate NVM,
 	 * also the receiver of IPI sent from polling cpu.
+	 *
+	 * Poll on the NVM node, where the whole socket can be frozen at
+	 * once, and emulate on the first cpu of any other node.
+	 *
+	 * Simulated boxes work on any machine, whose nodes may not even
+	 * exist. Poll here, emulate on whichever other cpu is online.
 	 */
-	polling_cpu = 6;
-	emulate_nvm_cpu = 0;
+	if (uncore_simulate) {
+		cfg->polling_cpu = smp_processor_id();
+		cfg->emulate_nvm_cpu = cpumask_any_but(cpu_online_mask,
+						       cfg->polling_cpu);
+		if (cfg->emulate_nvm_cpu >= nr_cpu_ids) {
+			pr_err("Simulation needs two online cpus at least");
+			kfree(cfg);
+			return -ENXIO;
+		}
+	} else {
+		if (nvm_node >= UNCORE_MAX_SOCKET || !node_online(nvm_node) ||
+		    first_online_cpu_of_node(nvm_node) < 0) {
+			pr_err("NVM node %u has no online cpu", nvm_node);
+			kfree(cfg);
+			return -EINVAL;
+		}
+		cfg->polling_cpu = first_online_cpu_of_node(nvm_node);
 
-	polling_node = cpu_to_node(polling_cpu);
-	emulate_nvm_node = cpu_to_node(emulate_nvm_cpu);
+		cfg->emulate_nvm_cpu = nr_cpu_ids;
+		for_each_online_cpu(cpu) {
+			if (cpu_to_node(cpu) != nvm_node) {
+				cfg->emulate_nvm_cpu = cpu;
+				break;
+			}
+		}
+		if (cfg->emulate_nvm_cpu >= nr_cpu_ids) {
+			pr_err("No online cpu out of NVM node %u", nvm_node);
+			kfree(cfg);
+			return -ENXIO;
+		}
+	}
+
+	/*
+	 * Start with the single cpu mode, switch to Per-CPU mode
+	 * by writing "cpus=<cpulist>" to /proc/emulate_nvm, then
+	 * to Local mode by writing "mode=local".
+	 */
+	cfg->mode = EMULATE_NVM_MODE_HA;
+	cpumask_clear(&cfg->cpus);
 
 	/*
 	 * Hrtimer Forward Duration (ns)
 	 * Default: 100 ms
 	 */
-	emulate_nvm_hrtimer_duration_ns = 1000000 * 100;
+	cfg->epoch_ns = 1000000 * 100;
+	emulate_nvm_epoch_ns = cfg->epoch_ns;
+
+	/*
+	 * Adaptive Epoch
+	 * Default: 100 us ~ 100 ms, 10000 HA counts per epoch
+	 */
+	cfg->epoch_min_ns = 1000 * 100;
+	cfg->epoch_max_ns = 1000000 * 100;
+	cfg->epoch_target = 10000;
+
+	/*
+	 * Counting Events
+	 * Remote requests at the HA of NVM node are NVM accesses
+	 */
+	cfg->read_event = uncore_catalog_find(EMULATE_NVM_READ_EVENT);
+	cfg->write_event = uncore_catalog_find(EMULATE_NVM_WRITE_EVENT);
+	if (!cfg->read_event || !cfg->write_event) {
+		pr_err("Default events not in catalog");
+		kfree(cfg);
+		return -ENOENT;
+	}
 
-	show_emulate_parameter();
+	emulate_nvm_shadow_config = *cfg;
+	rcu_assign_pointer(emulate_nvm_config, cfg);
+
+	return 0;
+}
+
+/*
+ * hrtimer, overflow handler and irq_works are all gone by now, only
+ * configs queued to RCU may still be around.
+ */
+static void emulate_nvm_free_configs(void)
+{
+	rcu_barrier_sched();
+	kfree(xchg(&emulate_nvm_next_config, NULL));
+	kfree(rcu_dereference_protected(emulate_nvm_config, 1));
+	RCU_INIT_POINTER(emulate_nvm_config, NULL);
+}
+
+#define pr_fail		printk(KERN_CONT "\033[31m fail \033[0m")
+#define pr_okay		printk(KERN_CONT "\033[32m okay \033[0m")
+
+#define PR_RESULT()	(ret)? pr_fail: pr_okay
+
+void start_emulate_nvm(void)
+{
+	int ret;
+
+	ret = emulate_nvm_init_config();
+	if (ret)
+		return;
+
+	show_emulate_parameter(&emulate_nvm_shadow_config);
 
 	pr_info("creating /proc/emulate_nvm... ");
 	ret = emulate_nvm_proc_create();
 	PR_RESULT();
 	if (ret)
-		return;
+		goto out_config;
+
+	emulate_nvm_place_pollers(&emulate_nvm_shadow_config);
 
 	pr_info("preparing platform... ");
-	ret = prepare_platform_configuration();
+	ret = prepare_platform_configuration(&emulate_nvm_shadow_config);
 	PR_RESULT();
 	if (ret)
 		goto out;
@@ -351,6 +1402,8 @@ out1:
 	restore_platform_configuration();
 out:
 	emulate_nvm_proc_remove();
+out_config:
+	emulate_nvm_free_configs();
 }
 
 void finish_emulate_nvm(void)
@@ -360,6 +1413,7 @@ void finish_emulate_nvm(void)
 		restore_platform_configuration();
 		finish_emulate_bandwidth();
 		finish_emulate_latency();
+		emulate_nvm_free_configs();
 		pr_info("finish emulating nvm... ");
 		emulation_started = false;
 	}
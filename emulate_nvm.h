@@ -16,8 +16,88 @@
  *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <linux/time.h>
+#include <linux/types.h>
+#include <linux/cpumask.h>
+#include <linux/rcupdate.h>
+
+struct uncore_event;
+
+/* Shortest epoch the polling hrtimer can sustain */
+#define EMULATE_NVM_MIN_EPOCH_NS	(10 * NSEC_PER_USEC)
+
+enum {
+	EMULATE_NVM_MODE_HA,
+	EMULATE_NVM_MODE_PERCPU,
+	EMULATE_NVM_MODE_LOCAL,
+
+	EMULATE_NVM_MODE_MAX,
+};
+
+enum {
+	EMULATE_NVM_MODEL_LINEAR,
+	EMULATE_NVM_MODEL_MLP,
+
+	EMULATE_NVM_MODEL_MAX,
+};
+
+/**
+ * struct emulate_nvm_config
+ * @dram_read_latency_ns:	read latency of DRAM
+ * @nvm_read_latency_ns:	read latency of emulated NVM
+ * @read_latency_delta_ns:	what every read miss is charged, derived
+ * @dram_write_latency_ns:	write latency of DRAM
+ * @nvm_write_latency_ns:	write latency of emulated NVM
+ * @write_latency_delta_ns:	what every write is charged, derived
+ * @nvm_write_bw_mbps:		write bandwidth ceiling of NVM in MB/s, 0 if none
+ * @model:			EMULATE_NVM_MODEL_XXX
+ * @mode:			EMULATE_NVM_MODE_XXX
+ * @polling_cpu:		cpu running the polling hrtimer
+ * @emulate_nvm_cpu:		cpu charged in HA mode
+ * @cpus:			cpus charged in Per-CPU and Local mode
+ * @epoch_ns:			epoch length when @epoch_target is 0
+ * @epoch_min_ns:		lower bound of adaptive epoch
+ * @epoch_max_ns:		upper bound of adaptive epoch
+ * @epoch_target:		HA counts per epoch to aim at
+ * @read_event:			HA event counted as NVM reads
+ * @write_event:		HA event counted as NVM writes
+ * @rcu:			to free the config after a swap
+ *
+ * One consistent set of emulation parameters. A published config is never
+ * modified, a new copy is published instead and the polling cpu swaps it in
+ * at the next epoch boundary.
+ */
+struct emulate_nvm_config {
+	u64			dram_read_latency_ns;
+	u64			nvm_read_latency_ns;
+	u64			read_latency_delta_ns;
+	u64			dram_write_latency_ns;
+	u64			nvm_write_latency_ns;
+	u64			write_latency_delta_ns;
+	u64			nvm_write_bw_mbps;
+
+	unsigned int		model;
+	unsigned int		mode;
+	unsigned int		polling_cpu;
+	unsigned int		emulate_nvm_cpu;
+	struct cpumask		cpus;
+
+	u64			epoch_ns;
+	u64			epoch_min_ns;
+	u64			epoch_max_ns;
+	u64			epoch_target;
+
+	struct uncore_event	*read_event;
+	struct uncore_event	*write_event;
+
+	struct rcu_head		rcu;
+};
+
 void start_emulate_nvm(void);
 void finish_emulate_nvm(void);
+void emulate_nvm_get_config(struct emulate_nvm_config *cfg);
+int emulate_nvm_set_config(const struct emulate_nvm_config *cfg);
+void emulate_nvm_polling_cpus(struct cpumask *mask);
 
 int emulate_nvm_proc_create(void);
 void emulate_nvm_proc_remove(void);
@@ -16,30 +16,102 @@
  *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include "uncore_pmu.h"
 #include "emulate_nvm.h"
 
 #include <asm/uaccess.h>
 
 #include <linux/list.h>
 #include <linux/init.h>
+#include <linux/slab.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/rcupdate.h>
 
-extern u64 read_latency_delta_ns;
+extern struct emulate_nvm_config __rcu *emulate_nvm_config;
 extern u64 hrtimer_jiffies;
+extern struct cpumask emulate_nvm_helper_cpus;
+extern u64 emulate_nvm_epoch_ns;
+extern u64 emulate_nvm_write_over_ns;
+extern u64 emulate_nvm_bw_over_ns;
+DECLARE_PER_CPU(u64, emulate_nvm_model_delay_ns);
+DECLARE_PER_CPU(u64, emulate_nvm_total_delay_ns);
+DECLARE_PER_CPU(s64, emulate_nvm_debt_ns);
 
 u64 proc_counts;
+u64 proc_write_counts;
+u64 proc_imc_counts;
 
+static const char * const emulate_nvm_mode_names[EMULATE_NVM_MODE_MAX] = {
+	[EMULATE_NVM_MODE_HA]		= "ha",
+	[EMULATE_NVM_MODE_PERCPU]	= "percpu",
+	[EMULATE_NVM_MODE_LOCAL]	= "local",
+};
+
+static const char * const emulate_nvm_model_names[EMULATE_NVM_MODEL_MAX] = {
+	[EMULATE_NVM_MODEL_LINEAR]	= "linear",
+	[EMULATE_NVM_MODEL_MLP]		= "mlp",
+};
+
+static void emulate_nvm_proc_show_cpu(struct seq_file *m, int cpu)
+{
+	seq_printf(m, "CPU %2d, model delay_ns = %llu, total delay_ns = %llu, debt_ns = %lld\n",
+		cpu,
+		per_cpu(emulate_nvm_model_delay_ns, cpu),
+		per_cpu(emulate_nvm_total_delay_ns, cpu),
+		per_cpu(emulate_nvm_debt_ns, cpu));
+}
+
+/* Show the config in effect, not the one waiting for next epoch */
 static int emulate_nvm_proc_show(struct seq_file *m, void *v)
 {
+	struct emulate_nvm_config *cfg;
+	int cpu;
+
+	rcu_read_lock_sched();
+	cfg = rcu_dereference_sched(emulate_nvm_config);
+
 	seq_printf(m, "this moment, counts=%llu, delay_ns=%llu\n",
-			proc_counts, proc_counts*read_latency_delta_ns);
+			proc_counts, proc_counts*cfg->read_latency_delta_ns);
+	seq_printf(m, "this moment, write counts=%llu, delay_ns=%llu\n",
+			proc_write_counts, proc_write_counts*cfg->write_latency_delta_ns);
+	seq_printf(m, "this moment, imc read counts=%llu\n", proc_imc_counts);
 	
 	seq_printf(m, "total jiffies = %llu\n", hrtimer_jiffies);
+	seq_printf(m, "epoch_ns = %llu, [%llu, %llu], target = %llu\n",
+			emulate_nvm_epoch_ns, cfg->epoch_min_ns,
+			cfg->epoch_max_ns, cfg->epoch_target);
+	seq_printf(m, "read_ns = %llu (dram %llu), write_ns = %llu (dram %llu)\n",
+			cfg->nvm_read_latency_ns, cfg->dram_read_latency_ns,
+			cfg->nvm_write_latency_ns, cfg->dram_write_latency_ns);
+	seq_printf(m, "polling cpu = %u, socket pollers = %*pbl\n",
+			cfg->polling_cpu, cpumask_pr_args(&emulate_nvm_helper_cpus));
+	seq_printf(m, "mode = %s\n", emulate_nvm_mode_names[cfg->mode]);
+	seq_printf(m, "model = %s\n", emulate_nvm_model_names[cfg->model]);
+	seq_printf(m, "read event = %s, write event = %s\n",
+			cfg->read_event->name, cfg->write_event->name);
+	seq_printf(m, "write ceiling = %llu MB/s, over ceiling ns = %llu\n",
+			cfg->nvm_write_bw_mbps, READ_ONCE(emulate_nvm_write_over_ns));
+	seq_printf(m, "software throttling ns = %llu\n",
+			READ_ONCE(emulate_nvm_bw_over_ns));
+
+	if (cfg->mode != EMULATE_NVM_MODE_HA) {
+		seq_printf(m, "emulated cpus = %*pbl\n",
+			cpumask_pr_args(&cfg->cpus));
+		for_each_cpu(cpu, &cfg->cpus)
+			emulate_nvm_proc_show_cpu(m, cpu);
+	} else
+		emulate_nvm_proc_show_cpu(m, cfg->emulate_nvm_cpu);
+
+	rcu_read_unlock_sched();
 	
 	return 0;
 }
@@ -49,24 +121,177 @@ static int emulate_nvm_proc_open(struct inode *inode, struct file *file)
 	return single_open(file, emulate_nvm_proc_show, NULL);
 }
 
+static DEFINE_MUTEX(emulate_nvm_proc_mutex);
+
+static int emulate_nvm_proc_cpus(struct emulate_nvm_config *cfg, char *val)
+{
+	int ret;
+
+	ret = cpulist_parse(val, &cfg->cpus);
+	if (ret)
+		return ret;
+
+	/* Setting cpus implies Per-CPU mode, unless Local mode is asked */
+	if (cpumask_empty(&cfg->cpus))
+		cfg->mode = EMULATE_NVM_MODE_HA;
+	else if (cfg->mode == EMULATE_NVM_MODE_HA)
+		cfg->mode = EMULATE_NVM_MODE_PERCPU;
+	return 0;
+}
+
+static int emulate_nvm_proc_mode(struct emulate_nvm_config *cfg, char *val)
+{
+	unsigned int mode;
+
+	for (mode = 0; mode < EMULATE_NVM_MODE_MAX; mode++) {
+		if (!strcmp(val, emulate_nvm_mode_names[mode])) {
+			cfg->mode = mode;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int emulate_nvm_proc_model(struct emulate_nvm_config *cfg, char *val)
+{
+	unsigned int model;
+
+	for (model = 0; model < EMULATE_NVM_MODEL_MAX; model++) {
+		if (!strcmp(val, emulate_nvm_model_names[model])) {
+			cfg->model = model;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/* Only HA events make sense, emulation counts at the HA of NVM node */
+static int emulate_nvm_proc_event(struct uncore_event **event, char *val)
+{
+	struct uncore_event *found;
+
+	found = uncore_catalog_find(val);
+	if (!found || !found->unit || strcmp(found->unit, "HA"))
+		return -EINVAL;
+
+	*event = found;
+	return 0;
+}
+
+#define EMULATE_NVM_PROC_U64(k, field)	\
+	{ .key = k, .offset = offsetof(struct emulate_nvm_config, field) }
+
+static const struct {
+	const char	*key;
+	size_t		offset;
+} emulate_nvm_proc_u64_keys[] = {
+	EMULATE_NVM_PROC_U64("dram_read_ns",	dram_read_latency_ns),
+	EMULATE_NVM_PROC_U64("nvm_read_ns",	nvm_read_latency_ns),
+	EMULATE_NVM_PROC_U64("dram_write_ns",	dram_write_latency_ns),
+	EMULATE_NVM_PROC_U64("nvm_write_ns",	nvm_write_latency_ns),
+	EMULATE_NVM_PROC_U64("nvm_write_mbps",	nvm_write_bw_mbps),
+	EMULATE_NVM_PROC_U64("epoch_ns",	epoch_ns),
+	EMULATE_NVM_PROC_U64("epoch_min_ns",	epoch_min_ns),
+	EMULATE_NVM_PROC_U64("epoch_max_ns",	epoch_max_ns),
+	EMULATE_NVM_PROC_U64("epoch_target",	epoch_target),
+};
+
+static int emulate_nvm_proc_parse(struct emulate_nvm_config *cfg,
+				  char *key, char *val)
+{
+	int i;
+
+	if (!strcmp(key, "cpus"))
+		return emulate_nvm_proc_cpus(cfg, val);
+	if (!strcmp(key, "mode"))
+		return emulate_nvm_proc_mode(cfg, val);
+	if (!strcmp(key, "model"))
+		return emulate_nvm_proc_model(cfg, val);
+	if (!strcmp(key, "polling_cpu"))
+		return kstrtouint(val, 0, &cfg->polling_cpu);
+	if (!strcmp(key, "emulate_cpu"))
+		return kstrtouint(val, 0, &cfg->emulate_nvm_cpu);
+	if (!strcmp(key, "read_event"))
+		return emulate_nvm_proc_event(&cfg->read_event, val);
+	if (!strcmp(key, "write_event"))
+		return emulate_nvm_proc_event(&cfg->write_event, val);
+
+	for (i = 0; i < ARRAY_SIZE(emulate_nvm_proc_u64_keys); i++) {
+		if (!strcmp(key, emulate_nvm_proc_u64_keys[i].key))
+			return kstrtoull(val, 0, (u64 *)((char *)cfg +
+					 emulate_nvm_proc_u64_keys[i].offset));
+	}
+	return -EINVAL;
+}
+
+/*
+ * One or more key=value pairs, separated by spaces. All pairs of a single
+ * write are published as one config, which takes effect at the next epoch
+ * boundary. Nothing is changed if any of them is invalid.
+ *
+ * cpus=<cpulist>	Inject latency to every cpu in cpulist, each cpu is
+ *			charged by its own LLC misses. An empty list goes back
+ *			to single emulated cpu mode.
+ * mode=<ha|percpu|local>
+ *			Switch the injection engine, see emulate_nvm.c
+ * model=<linear|mlp>	Switch the latency model, see counts_to_delay_ns
+ * dram_read_ns=<ns>
+ * nvm_read_ns=<ns>
+ * dram_write_ns=<ns>
+ * nvm_write_ns=<ns>	Latency model, deltas are charged
+ * nvm_write_mbps=<MB/s>
+ *			Write bandwidth ceiling, 0 for none. Writers going
+ *			beyond it are stalled, in HA and Per-CPU mode. Read
+ *			bandwidth is throttled by /proc/uncore_pmu instead
+ * polling_cpu=<cpu>	Move the master hrtimer to another cpu
+ * emulate_cpu=<cpu>	The cpu charged in HA mode, socket pollers can not
+ *			be emulated
+ * epoch_ns=<ns>	Epoch length when epoch_target is 0
+ * epoch_min_ns=<ns>
+ * epoch_max_ns=<ns>	Bounds of adaptive epoch
+ * epoch_target=<n>	HA counts per epoch to aim at, 0 for fixed epoch
+ * read_event=<name>
+ * write_event=<name>	HA events counted as NVM reads and writes, by their
+ *			name in /proc/uncore_events
+ */
 static ssize_t emulate_nvm_proc_write(struct file *file, const char __user *buf,
 				   size_t count, loff_t *offs)
 {
-	char ctl[2];
+	struct emulate_nvm_config *cfg;
+	char ctl[256], *p, *kv, *v;
+	int ret = 0;
 	
-	if (count !=2 || *offs)
+	if (count >= sizeof(ctl) || *offs)
 		return -EINVAL;
 	
 	if (copy_from_user(ctl, buf, count))
 		return -EFAULT;
-	
-	switch (ctl[0]) {
-		/*TODO modify parameters */
-		default:
-			count = -EINVAL;
+	ctl[count] = '\0';
+	p = strim(ctl);
+
+	cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return -ENOMEM;
+
+	mutex_lock(&emulate_nvm_proc_mutex);
+	emulate_nvm_get_config(cfg);
+	while (!ret && (kv = strsep(&p, " \t"))) {
+		if (!*kv)
+			continue;
+		v = strchr(kv, '=');
+		if (!v) {
+			ret = -EINVAL;
+			break;
+		}
+		*v++ = '\0';
+		ret = emulate_nvm_proc_parse(cfg, kv, v);
 	}
+	if (!ret)
+		ret = emulate_nvm_set_config(cfg);
+	mutex_unlock(&emulate_nvm_proc_mutex);
 
-	return count;
+	kfree(cfg);
+	return ret ? ret : count;
 }
 
 const struct file_operations emulate_nvm_proc_fops = {
@@ -81,7 +306,7 @@ static bool is_proc_registed = false;
 
 int __must_check emulate_nvm_proc_create(void)
 {
-	if (proc_create("emulate_nvm", 0444, NULL, &emulate_nvm_proc_fops)) {
+	if (proc_create("emulate_nvm", 0644, NULL, &emulate_nvm_proc_fops)) {
 		is_proc_registed = true;
 		return 0;
 	}
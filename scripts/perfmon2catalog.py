@@ -0,0 +1,99 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#
+# Convert Intel perfmon uncore JSON (e.g. haswellx_uncore_v*.json) into the
+# line format of /proc/uncore_events, see uncore_catalog.c:
+#
+#   ./perfmon2catalog.py haswellx_uncore.json HA iMC > hswep.events
+#   cat hswep.events > /proc/uncore_events
+#
+# Only units given are converted, all of them if none given. One write may
+# carry many lines, up to 64 KiB. Split bigger files at line boundaries,
+# e.g. with "split -C 64k", and write the pieces one by one.
+#
+
+import json
+import sys
+
+
+def counters_mask(counter):
+    mask = 0
+    for part in str(counter).split(','):
+        part = part.strip()
+        if not part or not part[0].isdigit():
+            continue
+        if '-' in part:
+            lo, hi = part.split('-')
+            for i in range(int(lo), int(hi) + 1):
+                mask |= 1 << i
+        else:
+            mask |= 1 << int(part)
+    return mask
+
+
+def convert(event):
+    code = event.get('EventCode', '')
+    if not code or ',' in code:
+        return None
+
+    line = '%s %s code=%s umask=%s' % (event['Unit'].replace(' ', '_'),
+                                       event['EventName'],
+                                       code, event.get('UMask', '0x0') or '0x0')
+
+    mask = counters_mask(event.get('Counter', ''))
+    if mask:
+        line += ' counters=0x%x' % mask
+
+    filter_value = event.get('FILTER_VALUE', '')
+    if filter_value and filter_value != '0':
+        line += ' filter=%s' % filter_value
+
+    # Not in every perfmon release, 0 tells the catalog it is unknown
+    line += ' max_inc=%d' % int(str(event.get('MaxIncr', '') or '0'), 0)
+
+    desc = event.get('BriefDescription', '')
+    if desc:
+        line += ' desc=%s' % desc.replace('\n', ' ')
+    return line
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write('Usage: %s <perfmon.json> [unit ...]\n' % sys.argv[0])
+        return 1
+
+    with open(sys.argv[1]) as f:
+        events = json.load(f)
+    if isinstance(events, dict):
+        events = events.get('Events', [])
+
+    units = set(sys.argv[2:])
+    for event in events:
+        if 'Unit' not in event or 'EventName' not in event:
+            continue
+        if units and event['Unit'] not in units:
+            continue
+        line = convert(event)
+        if line:
+            print(line)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -35,10 +35,11 @@ Start()
 	${INSTALL_MOD} ${UNCORE_PMU_MODULE}
 }
 
+# uncore.ko uses symbols of core.ko, remove it first
 End()
 {
-	${REMOVE_MOD} ${CORE_PMU_MODULE}
 	${REMOVE_MOD} ${UNCORE_PMU_MODULE}
+	${REMOVE_MOD} ${CORE_PMU_MODULE}
 }
 
 declare -i bw
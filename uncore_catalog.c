@@ -0,0 +1,294 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define pr_fmt(fmt) "UNCORE CATALOG: " fmt
+
+/*
+ * Uncore event catalog, all events known by name.
+ *
+ * Micro-architecture code registers its built-in events at init. More are
+ * loaded at runtime by writing lines to /proc/uncore_events, one event per
+ * line, as produced by scripts/perfmon2catalog.py from Intel perfmon JSON:
+ *
+ *	<unit> <name> code=<n> umask=<n> [counters=<mask>] [filter=<n>]
+ *		[max_inc=<n>] [desc=<text till end of line>]
+ *
+ * Entries are never changed nor freed before exit, users keep pointers to
+ * them. Loading a name again adds a new entry which shadows the old one.
+ */
+
+#include "uncore_pmu.h"
+
+#include <asm/uaccess.h>
+
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+/* Biggest blob accepted by one write */
+#define UNCORE_CATALOG_MAX_WRITE	(64 * 1024)
+
+/**
+ * struct uncore_catalog_entry
+ * @event:	the event, must be the first member
+ * @unit:	storage of event.unit
+ * @name:	storage of event.name
+ * @desc:	storage of event.desc
+ *
+ * Event loaded at runtime, which owns its strings.
+ */
+struct uncore_catalog_entry {
+	struct uncore_event	event;
+	char			unit[16];
+	char			name[UNCORE_EVENT_NAME_LEN];
+	char			desc[128];
+};
+
+/* Newest first, so loaded events shadow built-in ones */
+static LIST_HEAD(uncore_catalog);
+static DEFINE_MUTEX(uncore_catalog_mutex);
+
+/**
+ * uncore_catalog_add
+ * @event:	the event to add, must have a name
+ * Return:	Non-zero on failure
+ *
+ * Add @event into catalog. @event must live until uncore_catalog_exit.
+ */
+int uncore_catalog_add(struct uncore_event *event)
+{
+	if (!event || !event->name)
+		return -EINVAL;
+
+	mutex_lock(&uncore_catalog_mutex);
+	list_add(&event->next, &uncore_catalog);
+	mutex_unlock(&uncore_catalog_mutex);
+
+	return 0;
+}
+
+/**
+ * uncore_catalog_find
+ * @name:	perfmon name of the event
+ * Return:	%NULL if not found
+ *
+ * Find the newest event named @name. The event stays valid until exit.
+ */
+struct uncore_event *uncore_catalog_find(const char *name)
+{
+	struct uncore_event *event, *found = NULL;
+
+	mutex_lock(&uncore_catalog_mutex);
+	list_for_each_entry(event, &uncore_catalog, next) {
+		if (!strcmp(event->name, name)) {
+			found = event;
+			break;
+		}
+	}
+	mutex_unlock(&uncore_catalog_mutex);
+
+	return found;
+}
+
+/* Parse one line, see the top of this file */
+static int uncore_catalog_parse(char *line)
+{
+	struct uncore_catalog_entry *entry;
+	unsigned int code = 0, umask = 0;
+	bool has_code = false;
+	char *desc, *tok;
+	int ret = 0;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	/* Description runs till the end of line, spaces included */
+	desc = strstr(line, "desc=");
+	if (desc) {
+		*desc = '\0';
+		strlcpy(entry->desc, strim(desc + 5), sizeof(entry->desc));
+	}
+
+	tok = strsep(&line, " \t");
+	if (!tok || !*tok)
+		goto einval;
+	strlcpy(entry->unit, tok, sizeof(entry->unit));
+
+	if (!line)
+		goto einval;
+	line = skip_spaces(line);
+	tok = strsep(&line, " \t");
+	if (!tok || !*tok)
+		goto einval;
+	strlcpy(entry->name, tok, sizeof(entry->name));
+
+	while (!ret && (tok = strsep(&line, " \t"))) {
+		if (!*tok)
+			continue;
+
+		if (!strncmp(tok, "code=", 5)) {
+			ret = kstrtouint(tok + 5, 0, &code);
+			has_code = true;
+		} else if (!strncmp(tok, "umask=", 6))
+			ret = kstrtouint(tok + 6, 0, &umask);
+		else if (!strncmp(tok, "counters=", 9))
+			ret = kstrtouint(tok + 9, 0, &entry->event.counters);
+		else if (!strncmp(tok, "filter=", 7))
+			ret = kstrtoull(tok + 7, 0, &entry->event.filter);
+		else if (!strncmp(tok, "max_inc=", 8))
+			ret = kstrtouint(tok + 8, 0, &entry->event.max_inc);
+		else
+			ret = -EINVAL;
+	}
+
+	if (ret || !has_code || code > 0xFF || umask > 0xFF)
+		goto einval;
+
+	entry->event.enable	= UNCORE_EVENT_ENABLE(code, umask);
+	entry->event.disable	= 0;
+	entry->event.unit	= entry->unit;
+	entry->event.name	= entry->name;
+	entry->event.desc	= entry->desc;
+	entry->event.dynamic	= true;
+
+	return uncore_catalog_add(&entry->event);
+
+einval:
+	kfree(entry);
+	return -EINVAL;
+}
+
+static int uncore_catalog_proc_show(struct seq_file *m, void *v)
+{
+	struct uncore_event *event;
+
+	mutex_lock(&uncore_catalog_mutex);
+	list_for_each_entry(event, &uncore_catalog, next) {
+		seq_printf(m, "%-4s %-40s enable=0x%08llx counters=0x%02x max_inc=%u%s  %s\n",
+			event->unit ? event->unit : "-", event->name,
+			event->enable, event->counters, event->max_inc,
+			event->dynamic ? " (loaded)" : "",
+			event->desc ? event->desc : "");
+	}
+	mutex_unlock(&uncore_catalog_mutex);
+
+	return 0;
+}
+
+static int uncore_catalog_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, uncore_catalog_proc_show, NULL);
+}
+
+/*
+ * Load a blob of events, one per line. Empty lines and lines starting
+ * with '#' are skipped. Stop at the first bad line, lines before stay.
+ */
+static ssize_t uncore_catalog_proc_write(struct file *file,
+					 const char __user *buf,
+					 size_t count, loff_t *offs)
+{
+	char *blob, *line, *p;
+	int ret = 0;
+
+	if (!count || count > UNCORE_CATALOG_MAX_WRITE)
+		return -EINVAL;
+
+	blob = kmalloc(count + 1, GFP_KERNEL);
+	if (!blob)
+		return -ENOMEM;
+
+	if (copy_from_user(blob, buf, count)) {
+		kfree(blob);
+		return -EFAULT;
+	}
+	blob[count] = '\0';
+
+	p = blob;
+	while (!ret && (line = strsep(&p, "\n"))) {
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+
+		ret = uncore_catalog_parse(line);
+		if (ret)
+			pr_err("Bad event: %s", line);
+	}
+
+	kfree(blob);
+	return ret ? ret : count;
+}
+
+static const struct file_operations uncore_catalog_proc_fops = {
+	.open		= uncore_catalog_proc_open,
+	.read		= seq_read,
+	.write		= uncore_catalog_proc_write,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+static bool is_proc_registed = false;
+
+/**
+ * uncore_catalog_init
+ * Return:	Non-zero on failure
+ *
+ * Register built-in events and create /proc/uncore_events. Simulated boxes
+ * decode HSWEP events, so they use the same built-in events.
+ */
+int uncore_catalog_init(void)
+{
+	int ret;
+
+	ret = hswep_catalog_init();
+	if (ret)
+		return ret;
+
+	if (!proc_create("uncore_events", 0644, NULL, &uncore_catalog_proc_fops)) {
+		uncore_catalog_exit();
+		return -ENOENT;
+	}
+	is_proc_registed = true;
+
+	return 0;
+}
+
+void uncore_catalog_exit(void)
+{
+	struct uncore_event *event, *tmp;
+
+	if (is_proc_registed) {
+		remove_proc_entry("uncore_events", NULL);
+		is_proc_registed = false;
+	}
+
+	mutex_lock(&uncore_catalog_mutex);
+	list_for_each_entry_safe(event, tmp, &uncore_catalog, next) {
+		list_del(&event->next);
+		if (event->dynamic)
+			kfree(event);
+	}
+	mutex_unlock(&uncore_catalog_mutex);
+}
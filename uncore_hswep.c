@@ -48,8 +48,10 @@
 #define HSWEP_MSR_BOX_CTL_RST_CTRL	(1 << 0)	/* Reset Control */
 #define HSWEP_MSR_BOX_CTL_RST_CTRS	(1 << 1)	/* Reset Counters */
 #define HSWEP_MSR_BOX_CTL_FRZ		(1 << 8)	/* Freeze all counters */
+#define HSWEP_MSR_BOX_CTL_FRZ_EN	(1 << 16)	/* Respond to global freeze */
 #define HSWEP_MSR_BOX_CTL_INIT		(HSWEP_MSR_BOX_CTL_RST_CTRL | \
-					 HSWEP_MSR_BOX_CTL_RST_CTRS )
+					 HSWEP_MSR_BOX_CTL_RST_CTRS | \
+					 HSWEP_MSR_BOX_CTL_FRZ_EN )
 
 /* HSWEP MSR Counter-Level Control Register Bit Layout */
 #define HSWEP_MSR_EVNTSEL_EVENT		0x000000FF	/* Event to counted */
@@ -91,6 +93,10 @@
 #define HSWEP_MSR_PMON_GLOBAL_STATUS	0x701
 #define HSWEP_MSR_PMON_GLOBAL_CONFIG	0x702
 
+/* HSWEP Global Control Register Bit Layout */
+#define HSWEP_PMON_GLOBAL_CTL_UNFRZ_ALL	(1 << 29)	/* Un-Freeze all boxes */
+#define HSWEP_PMON_GLOBAL_CTL_FRZ_ALL	(1U << 31)	/* Freeze all boxes */
+
 /* HSWEP Uncore U-box */
 #define HSWEP_MSR_U_PMON_BOX_STATUS	0x708
 #define HSWEP_MSR_U_PMON_UCLK_FIXED_CTL	0x703
@@ -166,6 +172,7 @@
 static void hswep_uncore_msr_show_box(struct uncore_box *box)
 {
 	unsigned long long value;
+	unsigned int i;
 
 	pr_info("\033[034m---------------------- Show MSR Box ----------------------\033[0m");
 	pr_info("MSR Box %d, on Node %d", box->idx, box->nodeid);
@@ -176,14 +183,18 @@ static void hswep_uncore_msr_show_box(struct uncore_box *box)
 	rdmsrl(uncore_msr_box_status(box), value);
 	pr_info("MSR Box-level Status:  0x%llx", value);
 
-	if (box->event)
-		pr_info("... Current Event:     %s", box->event->desc);
+	for (i = 0; i < UNCORE_BOX_MAX_EVENTS; i++) {
+		if (box->events[i])
+			pr_info("... Event of Counter %u: %s", i, box->events[i]->desc);
+	}
 
-	rdmsrl(uncore_msr_perf_ctl(box), value);
-	pr_info("... Control Register:  0x%llx", value);
+	for (i = 0; i < box->box_type->num_counters; i++) {
+		rdmsrl(uncore_msr_perf_ctl(box, i), value);
+		pr_info("... Control Register %u: 0x%llx", i, value);
 
-	rdmsrl(uncore_msr_perf_ctr(box), value);
-	pr_info("... Counter Register:  0x%llx", value);
+		rdmsrl(uncore_msr_perf_ctr(box, i), value);
+		pr_info("... Counter Register %u: 0x%llx", i, value);
+	}
 }
 
 static void hswep_uncore_msr_init_box(struct uncore_box *box)
@@ -221,28 +232,30 @@ static void hswep_uncore_msr_disable_box(struct uncore_box *box)
 	}
 }
 
-static void hswep_uncore_msr_enable_event(struct uncore_box *box,
+static void hswep_uncore_msr_enable_event(struct uncore_box *box, unsigned int idx,
 					  struct uncore_event *event)
 {
-	wrmsrl(uncore_msr_perf_ctl(box), event->disable);
+	wrmsrl(uncore_msr_perf_ctl(box, idx), event->enable);
 }
 
-static void hswep_uncore_msr_disable_event(struct uncore_box *box,
+static void hswep_uncore_msr_disable_event(struct uncore_box *box, unsigned int idx,
 					   struct uncore_event *event)
 {
-	wrmsrl(uncore_msr_perf_ctl(box), event->enable);
+	wrmsrl(uncore_msr_perf_ctl(box, idx), event->disable);
 }
 
-static void hswep_uncore_msr_write_counter(struct uncore_box *box, u64 value)
+static void hswep_uncore_msr_write_counter(struct uncore_box *box, unsigned int idx,
+					   u64 value)
 {
-	wrmsrl(uncore_msr_perf_ctr(box), value & uncore_box_ctr_mask(box));
+	wrmsrl(uncore_msr_perf_ctr(box, idx), value & uncore_box_ctr_mask(box));
 }
 
-static void hswep_uncore_msr_read_counter(struct uncore_box *box, u64 *value)
+static void hswep_uncore_msr_read_counter(struct uncore_box *box, unsigned int idx,
+					  u64 *value)
 {
 	u64 tmp;
 
-	rdmsrl(uncore_msr_perf_ctr(box), tmp);
+	rdmsrl(uncore_msr_perf_ctr(box, idx), tmp);
 	*value = tmp & uncore_box_ctr_mask(box);
 }
 
@@ -363,7 +376,7 @@ struct uncore_box_type *HSWEP_UNCORE_MSR_TYPE[] = {
 static void hswep_uncore_pci_show_box(struct uncore_box *box)
 {
 	struct pci_dev *pdev = box->pdev;
-	unsigned int config, low, high;
+	unsigned int config, low, high, i;
 	
 	/* The same with some print functions... */
 	pr_info("\033[034m---------------------- Show PCI Box ----------------------\033[0m");
@@ -384,16 +397,24 @@ static void hswep_uncore_pci_show_box(struct uncore_box *box)
 	pci_read_config_dword(pdev, uncore_pci_box_status(box), &config);
 	pr_info("PCI Box-level Status:  0x%x", config);
 
-	if (box->event)
-		pr_info("... Current Event:     %s", box->event->desc);
+	for (i = 0; i < UNCORE_BOX_MAX_EVENTS; i++) {
+		if (box->events[i])
+			pr_info("... Event of Counter %u: %s", i, box->events[i]->desc);
+	}
+
+	/* Some boxes, e.g. IRP, have no generic counters described */
+	if (!box->box_type->perf_ctl)
+		return;
 
-	pci_read_config_dword(pdev, uncore_pci_perf_ctl(box), &config);
-	pr_info("... Control Register:  0x%x", config);
+	for (i = 0; i < box->box_type->num_counters; i++) {
+		pci_read_config_dword(pdev, uncore_pci_perf_ctl(box, i), &config);
+		pr_info("... Control Register %u: 0x%x", i, config);
 
-	pci_read_config_dword(pdev, uncore_pci_perf_ctr(box), &low);
-	pci_read_config_dword(pdev, uncore_pci_perf_ctr(box)+4, &high);
-	pr_info("... Counter Register:  0x%x<<32 | 0x%x ---> %Ld", high, low,
-		((u64)high << 32) | (u64)low);
+		pci_read_config_dword(pdev, uncore_pci_perf_ctr(box, i), &low);
+		pci_read_config_dword(pdev, uncore_pci_perf_ctr(box, i)+4, &high);
+		pr_info("... Counter Register %u: 0x%x<<32 | 0x%x ---> %Ld", i,
+			high, low, ((u64)high << 32) | (u64)low);
+	}
 }
 
 static void hswep_uncore_pci_init_box(struct uncore_box *box)
@@ -435,39 +456,49 @@ static void hswep_uncore_pci_disable_box(struct uncore_box *box)
 	}
 }
 
-static void hswep_uncore_pci_enable_event(struct uncore_box *box,
+static void hswep_uncore_pci_enable_event(struct uncore_box *box, unsigned int idx,
 					  struct uncore_event *event)
 {
 	pci_write_config_dword(box->pdev,
-			       uncore_pci_perf_ctl(box),
+			       uncore_pci_perf_ctl(box, idx),
 			       event->enable);
 }
 
-static void hswep_uncore_pci_disable_event(struct uncore_box *box,
+static void hswep_uncore_pci_disable_event(struct uncore_box *box, unsigned int idx,
 					   struct uncore_event *event)
 {
 	pci_write_config_dword(box->pdev,
-			       uncore_pci_perf_ctl(box),
+			       uncore_pci_perf_ctl(box, idx),
 			       event->disable);
 }
 
-static void hswep_uncore_pci_write_counter(struct uncore_box *box, u64 value)
+static void hswep_uncore_pci_write_counter(struct uncore_box *box, unsigned int idx,
+					   u64 value)
 {
 	u32 low, high;
 
 	low = (u32)(value & 0xffffffff);
 	high = (u32)((value & uncore_box_ctr_mask(box)) >> 32);
 
-	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr(box), low);
-	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr(box)+4, high);
+	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr(box, idx), low);
+	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr(box, idx)+4, high);
 }
 
-static void hswep_uncore_pci_read_counter(struct uncore_box *box, u64 *value)
+static void hswep_uncore_pci_read_counter(struct uncore_box *box, unsigned int idx,
+					  u64 *value)
 {
-	unsigned int low, high;
-
-	pci_read_config_dword(box->pdev, uncore_pci_perf_ctr(box), &low);
-	pci_read_config_dword(box->pdev, uncore_pci_perf_ctr(box)+4, &high);
+	u32 low, high, prev;
+
+	/*
+	 * Counters are read while running, low may wrap between the two
+	 * dword reads. Read high again, and retry if it moved.
+	 */
+	uncore_pci_read_dword(box, uncore_pci_perf_ctr(box, idx)+4, &high);
+	do {
+		prev = high;
+		uncore_pci_read_dword(box, uncore_pci_perf_ctr(box, idx), &low);
+		uncore_pci_read_dword(box, uncore_pci_perf_ctr(box, idx)+4, &high);
+	} while (high != prev);
 
 	*value = ((u64)high << 32) | (u64)low;
 	*value &= uncore_box_ctr_mask(box);
@@ -696,13 +727,18 @@ static int hswep_pcibus_to_nodeid(int devid)
 {
 	struct pci_dev *ubox = NULL;
 	unsigned int nodeid;
-	int err, mapping, bus, i;
+	int err, mapping, seg, bus, i;
 
 	while (1) {
 		ubox = pci_get_device(PCI_VENDOR_ID_INTEL, devid, ubox);
 		if (!ubox)
 			break;
+		seg = pci_domain_nr(ubox->bus);
 		bus = ubox->bus->number;
+		if (seg < 0 || seg >= UNCORE_MAX_PCI_SEGMENT) {
+			pr_err("Skip UBOX on segment %04x", seg);
+			continue;
+		}
 
 		/* Read Node ID Configuration Resgister */
 		err = pci_read_config_dword(ubox, 0x40, &nodeid);
@@ -717,7 +753,7 @@ static int hswep_pcibus_to_nodeid(int devid)
 		/* Every 3-bit maps a node */
 		for (i = 0; i < 8; i++) {
 			if (nodeid == ((mapping >> (i * 3)) & 0x7)) {
-				uncore_pcibus_to_nodeid[bus] = i;
+				uncore_pci_bus_node[seg][bus] = i;
 				break;
 			}
 		}
@@ -741,6 +777,8 @@ int hswep_cpu_init(void)
 	uncore_pmu.global_ctl		= HSWEP_MSR_PMON_GLOBAL_CTL;
 	uncore_pmu.global_status	= HSWEP_MSR_PMON_GLOBAL_STATUS;
 	uncore_pmu.global_config	= HSWEP_MSR_PMON_GLOBAL_CONFIG;
+	uncore_pmu.global_freeze	= HSWEP_PMON_GLOBAL_CTL_FRZ_ALL;
+	uncore_pmu.global_unfreeze	= HSWEP_PMON_GLOBAL_CTL_UNFRZ_ALL;
 
 	return 0;
 }
@@ -771,7 +809,8 @@ int hswep_pci_init(void)
  *
  * Note that: Users can set particuliar events using specific code/mask. The
  * following defined events are documented here because they could be used in
- * NVM emulation. I know all these event structure sucks. :(
+ * NVM emulation. They are built-in entries of the event catalog, find them by
+ * perfmon name with uncore_catalog_find.
  *****************************************************************************/
 
 /*
@@ -786,24 +825,32 @@ int hswep_pci_init(void)
  */
 
 /*
- * LOCAL_READS: This filter includes only read requests coming from the local
+ * READS_LOCAL: This filter includes only read requests coming from the local
  * socket. This is a good proxy for LLC Read Misses (including RFOs) from the
  * local socket.
  */
-struct uncore_event ha_requests_local_reads = {
-	.enable = (1<<22) | (1<<20) | 0x0100 | 0x0001,
+static struct uncore_event ha_requests_local_reads = {
+	.enable = UNCORE_EVENT_ENABLE(0x01, 0x01),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_REQUESTS.READS_LOCAL",
 	.desc = "Read requests coming from the local socket"
 };
 
 /*
- * REMOTE_READS: This filter includes only read requests coming from remote
+ * READS_REMOTE: This filter includes only read requests coming from remote
  * sockets. This is a good proxy for LLC Read Misses (including RFOs) from
  * remote sockets.
  */
-struct uncore_event ha_requests_remote_reads = {
-	.enable = (1<<22) | (1<<20) | 0x0200 | 0x0001,
+static struct uncore_event ha_requests_remote_reads = {
+	.enable = UNCORE_EVENT_ENABLE(0x01, 0x02),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_REQUESTS.READS_REMOTE",
 	.desc = "Read requests coming from remote sockets"
 };
 
@@ -811,36 +858,52 @@ struct uncore_event ha_requests_remote_reads = {
  * READS: Incoming read requests. This is a good proxy for LLC Read Misses (
  * including RFOs).
  */
-struct uncore_event ha_requests_reads = {
-	.enable = (1<<22) | (1<<20) | 0x0300 | 0x0001,
+static struct uncore_event ha_requests_reads = {
+	.enable = UNCORE_EVENT_ENABLE(0x01, 0x03),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_REQUESTS.READS",
 	.desc = "Incoming read requests total"
 };
 
 /*
- * LOCAL_WRITES: This filter includes only writes coming from the local socket.
+ * WRITES_LOCAL: This filter includes only writes coming from the local socket.
  */
-struct uncore_event ha_requests_local_writes = {
-	.enable = (1<<22) | (1<<20) | 0x0400 | 0x0001,
+static struct uncore_event ha_requests_local_writes = {
+	.enable = UNCORE_EVENT_ENABLE(0x01, 0x04),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_REQUESTS.WRITES_LOCAL",
 	.desc = "Write requests from local socket"
 };
 
 /*
- * REMOTE_WRITES: This filter includes only writes coming from remote sockets.
+ * WRITES_REMOTE: This filter includes only writes coming from remote sockets.
  */
-struct uncore_event ha_requests_remote_writes = {
-	.enable = (1<<22) | (1<<20) | 0x0800 | 0x0001,
+static struct uncore_event ha_requests_remote_writes = {
+	.enable = UNCORE_EVENT_ENABLE(0x01, 0x08),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_REQUESTS.WRITES_REMOTE",
 	.desc = "Write requests from remote socket"
 };
 
 /*
  * WRITES: Incoming write requests.
  */
-struct uncore_event ha_requests_writes = {
-	.enable = (1<<22) | (1<<20) | 0x0B00 | 0x0001,
+static struct uncore_event ha_requests_writes = {
+	.enable = UNCORE_EVENT_ENABLE(0x01, 0x0B),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_REQUESTS.WRITES",
 	.desc = "Incoming write requests total"
 };
 
@@ -854,9 +917,13 @@ struct uncore_event ha_requests_writes = {
  * This can be filtered by the priority of the reads. Note that, this event does
  * not count reads the bypass path. That is counted separately in HA_IMC.BYPASS.
  */
-struct uncore_event ha_imc_reads = {
-	.enable = (1<<22) | (1<<20) | 0x0100 | 0x0017,
+static struct uncore_event ha_imc_reads = {
+	.enable = UNCORE_EVENT_ENABLE(0x17, 0x01),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 4,
+	.unit = "HA",
+	.name = "UNC_H_IMC_READS.NORMAL",
 	.desc = "HA to IMC normal priority read requests"
 };
 
@@ -870,18 +937,84 @@ struct uncore_event ha_imc_reads = {
  * controller. This counts for all four channels. It can be filtered by full/partial
  * and ISOCH/non-ISOCH.
  */
-struct uncore_event ha_imc_writes_full = {
-	.enable = (1<<22) | (1<<20) | 0x0100 | 0x001A,
+static struct uncore_event ha_imc_writes_full = {
+	.enable = UNCORE_EVENT_ENABLE(0x1A, 0x01),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_IMC_WRITES.FULL",
 	.desc = "HA to IMC full-line Non-ISOCH write"
 };
 
-struct uncore_event ha_imc_writes_partial = {
-	.enable = (1<<22) | (1<<20) | 0x0200 | 0x001A,
+static struct uncore_event ha_imc_writes_partial = {
+	.enable = UNCORE_EVENT_ENABLE(0x1A, 0x02),
 	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "HA",
+	.name = "UNC_H_IMC_WRITES.PARTIAL",
 	.desc = "HA to IMC partial-line Non-ISOCH write"
 };
 
+/*
+ * IMC Events:		CAS_COUNT
+ * Event Code: 0x04
+ * Max. Inc/Cyc: 1
+ * Register Restrictions: 0-3
+ *
+ * DRAM RD_CAS and WR_CAS Commands of a channel. Every CAS moves a cacheline,
+ * so 64 times the count is the bandwidth of the channel.
+ */
+static struct uncore_event imc_cas_count_rd = {
+	.enable = UNCORE_EVENT_ENABLE(0x04, 0x03),
+	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "iMC",
+	.name = "UNC_M_CAS_COUNT.RD",
+	.desc = "All DRAM Read CAS Commands issued"
+};
+
+static struct uncore_event imc_cas_count_wr = {
+	.enable = UNCORE_EVENT_ENABLE(0x04, 0x0C),
+	.disable = 0,
+	.counters = 0x0F,
+	.max_inc = 1,
+	.unit = "iMC",
+	.name = "UNC_M_CAS_COUNT.WR",
+	.desc = "All DRAM Write CAS Commands issued"
+};
+
+static struct uncore_event *HSWEP_UNCORE_EVENTS[] = {
+	&ha_requests_local_reads,
+	&ha_requests_remote_reads,
+	&ha_requests_reads,
+	&ha_requests_local_writes,
+	&ha_requests_remote_writes,
+	&ha_requests_writes,
+	&ha_imc_reads,
+	&ha_imc_writes_full,
+	&ha_imc_writes_partial,
+	&imc_cas_count_rd,
+	&imc_cas_count_wr,
+	NULL
+};
+
+/* Built-in events, more could be loaded through /proc/uncore_events */
+int hswep_catalog_init(void)
+{
+	int i, ret;
+
+	for (i = 0; HSWEP_UNCORE_EVENTS[i]; i++) {
+		ret = uncore_catalog_add(HSWEP_UNCORE_EVENTS[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 /******************************************************************************
  * Integrated Memory Controller (IMC) Part
  *
@@ -896,15 +1029,24 @@ struct uncore_event ha_imc_writes_partial = {
  * IMC1, Channel 2-3 --> 21:0 21:1 (2fb0 2fb1)
  *
  * IMC1, Channel 2-3 --> 23:0 23:1 (2fd0 2fd1)
+ *
+ * Channels are numbered like IMC PMON boxes above, so the controller
+ * and the PMON table agree on which channel is which.
  */
 
 static const struct pci_device_id HSWEP_E5_IMC[] = {
-	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB4), },
-	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB5), },
-	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB0), },
-	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB1), },
-	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FD0), },
-	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FD1), },
+	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB4),
+	  .driver_data = UNCORE_IMC_DEV_DATA(0, 2), },
+	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB5),
+	  .driver_data = UNCORE_IMC_DEV_DATA(0, 3), },
+	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB0),
+	  .driver_data = UNCORE_IMC_DEV_DATA(0, 0), },
+	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FB1),
+	  .driver_data = UNCORE_IMC_DEV_DATA(0, 1), },
+	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FD0),
+	  .driver_data = UNCORE_IMC_DEV_DATA(1, 0), },
+	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, 0x2FD1),
+	  .driver_data = UNCORE_IMC_DEV_DATA(1, 1), },
 	{ 0, }
 };
 
@@ -912,77 +1054,49 @@ static const struct pci_device_id HSWEX_E7_IMC[] = {
 	{ 0, }
 };
 
-/*
- * This test wants to use [dimm_temp_thrt_lmt_[0:2]] to throttle
- * bandwidth. After some tests, it turns out that: THRT_CRIT and
- * THRT_MID has very very little impact on bandwidth(critical only?).
- * So, what do they mean? what is critical or middle transactions?
- *
- * THRT_HI can throttle the memory bandwidth. But it is weird.
- */
-__always_unused static void __test2(struct pci_dev *pdev)
-{
-	unsigned int config, offset;
-	int i;
-
-	for (i = 0; i < 3; i++) {
-		offset = 0x130 + 4 * i;
-		pci_read_config_dword(pdev, offset, &config);
-		config = 0x00ffff;
-		pci_write_config_dword(pdev, offset, config);
-	}
-	pci_read_config_dword(pdev, 0x134, &config);
-	pr_info("%x", config);
-}
-
-/*
- * This test wants to use [chn_tmp_cfg] to throttle bandwidth.
- * According to datasheet, some fields seems like be able to
- * throttle the bandwidth. After some tests, it turns out this
- * register has *no* impact on bandwidth.
- */
-__always_unused static void __test3(struct pci_dev *pdev)
-{
-	unsigned int config;
-
-	pci_read_config_dword(pdev, 0x108, &config);
-	config |= 0x3ff;
-	config |= 0x0f0000;
-	pci_write_config_dword(pdev, 0x108, config);
-	pci_read_config_dword(pdev, 0x108, &config);
-	pr_info("%x", config);
-}
-
 /*
  * Use [thrt_pwr_dimm_[0:2]].THRT_PWR to throttle bandwidth.
  * Bit 11:0, default value after hardware reset: 0xfff
  * Seriously Yizhou, you should learn more about MC/DRAM! :(
+ *
+ * Bandwidth goes down with THRT_PWR, but not in proportion. Let the
+ * controller in uncore_imc.c find the value for a given bandwidth, or
+ * measure the curve with uncore_imc_calib.c.
  */
-static int hswep_imc_set_threshold(struct pci_dev *pdev, unsigned int threshold)
+static void hswep_imc_set_thrt_pwr(struct uncore_imc *imc, unsigned int dimms,
+				   unsigned int thrt)
 {
+	struct pci_dev *pdev = imc->pdev;
 	u32 offset, i;
 	u16 config;
-	
+
 	/* 3 DIMMs Per Channel are populated at most */
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < UNCORE_IMC_DIMMS_PER_CHANNEL; i++) {
+		if (!(dimms & (1 << i)))
+			continue;
 		offset = 0x190 + 2 * i;
-		
+
 		pci_read_config_word(pdev, offset, &config);
 		config &= (1 << 15);
-		
-		/* XXX Relationship???? */
-		switch (threshold) {
-			case 2: /* 1/2 */
-				config |= 0x00ff;
-				break;
-			case 4: /* 1/4 */
-				config |= 0x007f;
-				break;
-			default:
-				config |= 0x0fff;
-		}
+		config |= thrt & UNCORE_IMC_THRT_PWR_MAX;
 		pci_write_config_word(pdev, offset, config);
 	}
+}
+
+/* Fixed ratios, measured once, open loop */
+static int hswep_imc_set_threshold(struct uncore_imc *imc, unsigned int threshold)
+{
+	switch (threshold) {
+		case 2: /* 1/2 */
+			hswep_imc_set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS, 0x00ff);
+			break;
+		case 4: /* 1/4 */
+			hswep_imc_set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS, 0x007f);
+			break;
+		default:
+			hswep_imc_set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS,
+					       UNCORE_IMC_THRT_PWR_MAX);
+	}
 
 	return 0;
 }
@@ -991,8 +1105,9 @@ static int hswep_imc_set_threshold(struct pci_dev *pdev, unsigned int threshold)
  * Use [thrt_pwr_dimm_[0:2]].THRT_PER_EN bit to enable throttling
  * Bit 15:15, default value after hardware reset: 0x1 (Enable)
  */
-static int hswep_imc_enable_throttle(struct pci_dev *pdev)
+static int hswep_imc_enable_throttle(struct uncore_imc *imc)
 {
+	struct pci_dev *pdev = imc->pdev;
 	u32 offset, i;
 	u16 config;
 
@@ -1006,8 +1121,9 @@ static int hswep_imc_enable_throttle(struct pci_dev *pdev)
 	return 0;
 }
 
-static void hswep_imc_disable_throttle(struct pci_dev *pdev)
+static void hswep_imc_disable_throttle(struct uncore_imc *imc)
 {
+	struct pci_dev *pdev = imc->pdev;
 	u32 offset, i;
 	u16 config;
 
@@ -1020,10 +1136,30 @@ static void hswep_imc_disable_throttle(struct pci_dev *pdev)
 	}
 }
 
+/* Whole [thrt_pwr_dimm_[0:2]], THRT_PER_EN included */
+static void hswep_imc_save_thrt_pwr(struct uncore_imc *imc, u16 *regs)
+{
+	u32 i;
+
+	for (i = 0; i < UNCORE_IMC_DIMMS_PER_CHANNEL; i++)
+		pci_read_config_word(imc->pdev, 0x190 + 2 * i, &regs[i]);
+}
+
+static void hswep_imc_restore_thrt_pwr(struct uncore_imc *imc, const u16 *regs)
+{
+	u32 i;
+
+	for (i = 0; i < UNCORE_IMC_DIMMS_PER_CHANNEL; i++)
+		pci_write_config_word(imc->pdev, 0x190 + 2 * i, regs[i]);
+}
+
 static const struct uncore_imc_ops HSWEP_E5_IMC_OPS = {
 	.set_threshold		= hswep_imc_set_threshold,
+	.set_thrt_pwr		= hswep_imc_set_thrt_pwr,
 	.enable_throttle	= hswep_imc_enable_throttle,
-	.disable_throttle	= hswep_imc_disable_throttle
+	.disable_throttle	= hswep_imc_disable_throttle,
+	.save_thrt_pwr		= hswep_imc_save_thrt_pwr,
+	.restore_thrt_pwr	= hswep_imc_restore_thrt_pwr
 };
 
 int hswep_imc_init(void)
@@ -31,17 +31,64 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
 #include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
 
 const struct pci_device_id *uncore_imc_device_ids;
 const struct uncore_imc_ops *uncore_imc_ops;
 LIST_HEAD(uncore_imc_devices);
 
+/*
+ * Bandwidth controller. Every bw_control_us, each channel of a node with a
+ * target counts its CAS commands since last time, and moves THRT_PWR toward
+ * the value which hits the target. Bandwidth is taken as proportional to
+ * THRT_PWR, which it is not quite, the loop corrects the rest.
+ */
+static unsigned int bw_control_us = 1000;
+module_param(bw_control_us, uint, 0444);
+MODULE_PARM_DESC(bw_control_us, "Period of the bandwidth controller in us (default: 1000)");
+
+#define UNCORE_IMC_CAS_RD_EVENT		"UNC_M_CAS_COUNT.RD"
+#define UNCORE_IMC_CAS_WR_EVENT		"UNC_M_CAS_COUNT.WR"
+
+/*
+ * Throttle in software even if the IMC could do it, see uncore_imc_sw.c.
+ * IMCs which can not be throttled fall back to it anyway.
+ */
+static bool sw_throttle = false;
+module_param(sw_throttle, bool, 0444);
+MODULE_PARM_DESC(sw_throttle, "Throttle bandwidth in software (default: 0)");
+
+static DEFINE_MUTEX(uncore_imc_mutex);
+static struct hrtimer uncore_imc_hrtimer;
+static bool uncore_imc_controlling = false;
+static bool uncore_imc_calibrating = false;
+static unsigned int uncore_imc_calib_nodeid;
+static u64 uncore_imc_last_ns;
+
+static void uncore_imc_stop_control(void);
+static void uncore_imc_pause(void);
+static int uncore_imc_resume(void);
+
+/* Channels of @nodeid belong to calibration, called with mutex held */
+static inline bool uncore_imc_calib_owns(unsigned int nodeid)
+{
+	return uncore_imc_calibrating && uncore_imc_calib_nodeid == nodeid;
+}
+
 void uncore_imc_exit(void)
 {
 	struct list_head *head;
 	struct uncore_imc *imc;
 
+	mutex_lock(&uncore_imc_mutex);
+	uncore_imc_stop_control();
+	mutex_unlock(&uncore_imc_mutex);
+
 	head = &uncore_imc_devices;
 	while (!list_empty(head)) {
 		imc = list_first_entry(head, struct uncore_imc, next);
@@ -55,11 +102,13 @@ void uncore_imc_exit(void)
 /**
  * uncore_imc_new_device
  * @pdev:		the pci device instance
+ * @data:		driver_data of its id, which IMC and channel it is
  * Return:		Non-zero on failure
  *
  * Add a new IMC struct to the list.
  */
-static int __must_check uncore_imc_new_device(struct pci_dev *pdev)
+static int __must_check uncore_imc_new_device(struct pci_dev *pdev,
+					      unsigned long data)
 {
 	struct uncore_imc *imc;
 	int nodeid;
@@ -71,11 +120,13 @@ static int __must_check uncore_imc_new_device(struct pci_dev *pdev)
 	if (!imc)
 		return -ENOMEM;
 	
-	nodeid = uncore_pcibus_to_nodeid[pdev->bus->number];
-	WARN_ONCE((nodeid < 0) || (nodeid > UNCORE_MAX_SOCKET), 
+	nodeid = uncore_pcibus_to_nodeid(pdev->bus);
+	WARN_ONCE((nodeid < 0) || (nodeid >= UNCORE_MAX_SOCKET), 
 		"Invalid Node ID: %d, check pci-node mapping", nodeid);
 
 	imc->nodeid = nodeid;
+	imc->mc = UNCORE_IMC_DEV_MC(data);
+	imc->channel = UNCORE_IMC_DEV_CHANNEL(data);
 	imc->pdev = pdev;
 	imc->ops = uncore_imc_ops;
 	list_add_tail(&imc->next, &uncore_imc_devices);
@@ -83,11 +134,28 @@ static int __must_check uncore_imc_new_device(struct pci_dev *pdev)
 	return 0;
 }
 
+static int uncore_imc_init_sw(void)
+{
+	int ret;
+
+	ret = sw_imc_init();
+	if (ret)
+		uncore_imc_exit();
+	return ret;
+}
+
 int __must_check uncore_imc_init(void)
 {
 	const struct pci_device_id *ids;
 	struct pci_dev *pdev;
 	int ret;
+
+	/* Simulated IMCs have no pci device, they are added by sim */
+	if (uncore_simulate)
+		return sim_imc_init();
+
+	if (sw_throttle)
+		return uncore_imc_init_sw();
 	
 	ret = -ENXIO;
 	switch (boot_cpu_data.x86_model) {
@@ -102,12 +170,15 @@ int __must_check uncore_imc_init(void)
 			pr_err("Buy an E5-v3");
 	};
 
-	if (ret)
-		return ret;
+	if (ret) {
+		pr_info("IMC can not be throttled, do it in software");
+		return uncore_imc_init_sw();
+	}
 	
 	/* IMC part need all low-level CPU-specific methods. */
 	if (!uncore_imc_ops			||
 	    !uncore_imc_ops->set_threshold	||
+	    !uncore_imc_ops->set_thrt_pwr	||
 	    !uncore_imc_ops->enable_throttle	||
 	    !uncore_imc_ops->disable_throttle)
 		return -EINVAL;
@@ -123,11 +194,16 @@ int __must_check uncore_imc_init(void)
 			
 			/* See uncore_pmu.c for why */
 			get_device(&pdev->dev);
-			ret = uncore_imc_new_device(pdev);
+			ret = uncore_imc_new_device(pdev, ids->driver_data);
 			if (ret)
 				goto out;
 		}
 	}
+
+	if (list_empty(&uncore_imc_devices)) {
+		pr_info("No IMC device found, throttle in software");
+		return uncore_imc_init_sw();
+	}
 	return 0;
 
 out:
@@ -145,24 +221,48 @@ out:
  *   If @threshold = 1, the bandwidth after throttling is: BW
  *   If @threshold = 2, the bandwidth after throttling is: BW/2
  *
- * The biggest @threshold depends on specific CPU.
+ * The biggest @threshold depends on specific CPU. If @nodeid is calibrated,
+ * THRT_PWR is interpolated from its table, see uncore_imc_calib.c. If not,
+ * it is up to the CPU-specific method.
+ *
+ * Like uncore_imc_set_thrt_pwr, channels of @nodeid are taken away from the
+ * controller, so the next period does not overwrite the threshold.
  */
 int uncore_imc_set_threshold(unsigned int nodeid, unsigned int threshold)
 {
 	struct uncore_imc *imc;
-	int ret = -ENXIO;
+	unsigned int thrt;
+	int ret = -ENXIO, err;
 
-	if (nodeid > UNCORE_MAX_SOCKET)
+	if (nodeid >= UNCORE_MAX_SOCKET || !threshold)
 		return -EINVAL;
 
+	thrt = uncore_calib_thrt(nodeid, threshold);
+
+	mutex_lock(&uncore_imc_mutex);
+	if (uncore_imc_calib_owns(nodeid)) {
+		mutex_unlock(&uncore_imc_mutex);
+		return -EBUSY;
+	}
+	uncore_imc_pause();
+
 	list_for_each_entry(imc, &uncore_imc_devices, next) {
-		if (imc->nodeid == nodeid) {
-			ret = imc->ops->set_threshold(imc->pdev, threshold);
-			if (ret)
-				break;
+		if (imc->nodeid != nodeid)
+			continue;
+		imc->target = 0;
+		if (thrt) {
+			imc->ops->set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS, thrt);
+			ret = 0;
+			continue;
 		}
+		ret = imc->ops->set_threshold(imc, threshold);
+		if (ret)
+			break;
 	}
-	return ret;
+
+	err = uncore_imc_resume();
+	mutex_unlock(&uncore_imc_mutex);
+	return ret ? ret : err;
 }
 
 /**
@@ -176,12 +276,12 @@ void uncore_imc_disable_throttle(unsigned int nodeid)
 {
 	struct uncore_imc *imc;
 
-	if (nodeid > UNCORE_MAX_SOCKET)
+	if (nodeid >= UNCORE_MAX_SOCKET)
 		return;
 
 	list_for_each_entry(imc, &uncore_imc_devices, next) {
 		if (imc->nodeid == nodeid)
-			imc->ops->disable_throttle(imc->pdev);
+			imc->ops->disable_throttle(imc);
 	}
 }
 
@@ -199,12 +299,12 @@ int uncore_imc_enable_throttle(unsigned int nodeid)
 	struct uncore_imc *imc;
 	int ret = -ENXIO;
 
-	if (nodeid > UNCORE_MAX_SOCKET)
+	if (nodeid >= UNCORE_MAX_SOCKET)
 		return -EINVAL;
 
 	list_for_each_entry(imc, &uncore_imc_devices, next) {
 		if (imc->nodeid == nodeid) {
-			ret = imc->ops->enable_throttle(imc->pdev);
+			ret = imc->ops->enable_throttle(imc);
 			if (ret) {
 				uncore_imc_disable_throttle(nodeid);
 				break;
@@ -262,14 +362,509 @@ void uncore_imc_disable_throttle_all(void)
 		uncore_imc_disable_throttle(node);
 }
 
+/*
+ * Simulated IMCs and their PMON boxes have no pci device, but there is
+ * only one of each per node, so matching @pdev works for both.
+ */
+static struct uncore_box *uncore_imc_find_box(struct uncore_imc *imc)
+{
+	struct uncore_box_type *type;
+	struct uncore_box *box;
+	unsigned int idx;
+
+	type = uncore_pci_type[UNCORE_PCI_IMC_ID];
+	for (idx = 0; idx < UNCORE_MAX_BOXES; idx++) {
+		box = uncore_get_box(type, idx, imc->nodeid);
+		if (box && box->pdev == imc->pdev)
+			return box;
+	}
+	return NULL;
+}
+
+/* Count CAS reads and writes on PMON boxes of all channels */
+static int uncore_imc_bind_boxes(void)
+{
+	struct uncore_event *rd, *wr;
+	struct uncore_imc *imc;
+	int ret;
+
+	rd = uncore_catalog_find(UNCORE_IMC_CAS_RD_EVENT);
+	wr = uncore_catalog_find(UNCORE_IMC_CAS_WR_EVENT);
+	if (!rd || !wr)
+		return -ENOENT;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		imc->box = uncore_imc_find_box(imc);
+		if (!imc->box)
+			continue;
+
+		/* Reads go to counter 0, writes to counter 1 */
+		ret = -EBUSY;
+		if (!imc->box->num_events)
+			ret = uncore_box_add_event(imc->box, rd);
+		if (ret >= 0)
+			ret = uncore_box_add_event(imc->box, wr);
+		if (ret < 0) {
+			pr_err("Fail to count CAS on IMC of node %u", imc->nodeid);
+			if (ret != -EBUSY)
+				uncore_box_del_events(imc->box);
+			imc->box = NULL;
+			continue;
+		}
+		uncore_enable_box(imc->box);
+		imc->thrt = UNCORE_IMC_THRT_PWR_MAX;
+		imc->mbps = 0;
+	}
+	return 0;
+}
+
+static void uncore_imc_unbind_boxes(void)
+{
+	struct uncore_imc *imc;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (!imc->box)
+			continue;
+		if (imc->target)
+			imc->ops->set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS,
+					       UNCORE_IMC_THRT_PWR_MAX);
+		imc->target = 0;
+		uncore_disable_box(imc->box);
+		uncore_box_del_events(imc->box);
+		imc->box = NULL;
+	}
+}
+
+/* Next THRT_PWR of a channel which did @mbps at @thrt */
+static unsigned int uncore_imc_next_thrt(unsigned int thrt, u64 mbps,
+					 unsigned int target)
+{
+	u64 want;
+
+	/* Idle tells nothing, open up so the next burst gets measured */
+	if (!mbps)
+		return min_t(unsigned int, thrt * 2, UNCORE_IMC_THRT_PWR_MAX);
+
+	/* At most double or halve, then go halfway there */
+	want = div64_u64((u64)thrt * target, mbps);
+	want = clamp_t(u64, want, thrt / 2, thrt * 2);
+	want = (thrt + want) / 2;
+
+	return clamp_t(u64, want, 1, UNCORE_IMC_THRT_PWR_MAX);
+}
+
+static enum hrtimer_restart uncore_imc_hrtimer_func(struct hrtimer *hrtimer)
+{
+	struct uncore_imc *imc;
+	u64 values[UNCORE_BOX_MAX_EVENTS];
+	u64 now, dt;
+	unsigned int target, thrt;
+
+	now = ktime_get_ns();
+	dt = now - uncore_imc_last_ns;
+	uncore_imc_last_ns = now;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (!imc->box)
+			continue;
+
+		/* Counter 0 counts reads, counter 1 writes */
+		uncore_box_read_events(imc->box, values);
+		imc->mbps = div64_u64((values[0] + values[1]) *
+				      UNCORE_IMC_CAS_BYTES * 1000, dt ? : 1);
+
+		target = READ_ONCE(imc->target);
+		if (!target)
+			continue;
+
+		thrt = uncore_imc_next_thrt(imc->thrt, imc->mbps, target);
+		if (thrt != imc->thrt) {
+			imc->ops->set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS, thrt);
+			imc->thrt = thrt;
+		}
+	}
+
+	hrtimer_forward_now(hrtimer, ns_to_ktime(bw_control_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+static void uncore_imc_stop_control(void)
+{
+	if (!uncore_imc_controlling)
+		return;
+
+	hrtimer_cancel(&uncore_imc_hrtimer);
+	uncore_imc_unbind_boxes();
+	uncore_imc_controlling = false;
+}
+
+static int uncore_imc_start_control(void)
+{
+	struct uncore_imc *imc;
+	u64 values[UNCORE_BOX_MAX_EVENTS];
+	int ret;
+
+	if (uncore_imc_controlling)
+		return 0;
+	if (!bw_control_us)
+		return -EINVAL;
+
+	ret = uncore_imc_bind_boxes();
+	if (ret)
+		return ret;
+
+	/* Drop counts from before, the first period starts now */
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (imc->box)
+			uncore_box_read_events(imc->box, values);
+	}
+	uncore_imc_last_ns = ktime_get_ns();
+
+	hrtimer_init(&uncore_imc_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	uncore_imc_hrtimer.function = uncore_imc_hrtimer_func;
+	hrtimer_start(&uncore_imc_hrtimer,
+		      ns_to_ktime(bw_control_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+
+	uncore_imc_controlling = true;
+	return 0;
+}
+
+/**
+ * uncore_imc_charge
+ * @nodeid:	NUMA node the bytes went to
+ * @bytes:	bytes moved since last call
+ * Return:	ns consumers of @nodeid have to stall
+ *
+ * Report bandwidth consumed on @nodeid. IMCs throttled by hardware slow
+ * consumers down by themselves and always return 0. Software throttled
+ * ones return the stall which keeps consumers within the throttled rate.
+ * Safe in any context.
+ */
+u64 uncore_imc_charge(unsigned int nodeid, u64 bytes)
+{
+	struct uncore_imc *imc;
+	u64 stall = 0;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (imc->nodeid == nodeid && imc->ops->charge)
+			stall += imc->ops->charge(imc, bytes);
+	}
+	return stall;
+}
+
+/* Keep the controller off channels while they are changed */
+static void uncore_imc_pause(void)
+{
+	if (uncore_imc_controlling)
+		hrtimer_cancel(&uncore_imc_hrtimer);
+}
+
+/*
+ * Run the controller again, as long as some channel has a target. Counts
+ * of the pause go to the next period, which is as long as the pause too.
+ */
+static int uncore_imc_resume(void)
+{
+	struct uncore_imc *imc;
+	bool any = false;
+	int ret;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next)
+		any |= !!imc->target;
+
+	if (!any) {
+		uncore_imc_stop_control();
+		return 0;
+	}
+
+	if (!uncore_imc_controlling) {
+		ret = uncore_imc_start_control();
+		if (ret) {
+			list_for_each_entry(imc, &uncore_imc_devices, next)
+				imc->target = 0;
+		}
+		return ret;
+	}
+
+	hrtimer_start(&uncore_imc_hrtimer,
+		      ns_to_ktime(bw_control_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+	return 0;
+}
+
+static bool uncore_imc_match(struct uncore_imc *imc, unsigned int nodeid,
+			     int mc, int channel)
+{
+	return imc->nodeid == nodeid &&
+	       (mc == UNCORE_IMC_ANY || imc->mc == mc) &&
+	       (channel == UNCORE_IMC_ANY || imc->channel == channel);
+}
+
+/**
+ * uncore_imc_set_thrt_pwr
+ * @nodeid:	NUMA node of the channels
+ * @mc:		IMC of the channels, or UNCORE_IMC_ANY
+ * @channel:	channel within @mc, or UNCORE_IMC_ANY
+ * @dimms:	bit mask of DIMM slots to throttle
+ * @thrt:	raw THRT_PWR, 1 to UNCORE_IMC_THRT_PWR_MAX
+ * Return:	0 on success, -ENXIO if no channel matches
+ *
+ * Throttle some DIMMs of some channels, open loop, and leave others as they
+ * are. With address ranges mapped to channels or DIMMs, one node can have
+ * fast and slow memory at the same time. Matched channels are taken away
+ * from the controller.
+ */
+int uncore_imc_set_thrt_pwr(unsigned int nodeid, int mc, int channel,
+			    unsigned int dimms, unsigned int thrt)
+{
+	struct uncore_imc *imc;
+	int ret = -ENXIO, err;
+
+	if (nodeid >= UNCORE_MAX_SOCKET)
+		return -EINVAL;
+	if (!thrt || thrt > UNCORE_IMC_THRT_PWR_MAX)
+		return -EINVAL;
+	if (!dimms || (dimms & ~UNCORE_IMC_ALL_DIMMS))
+		return -EINVAL;
+
+	mutex_lock(&uncore_imc_mutex);
+	if (uncore_imc_calib_owns(nodeid)) {
+		mutex_unlock(&uncore_imc_mutex);
+		return -EBUSY;
+	}
+	uncore_imc_pause();
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (!uncore_imc_match(imc, nodeid, mc, channel))
+			continue;
+		imc->target = 0;
+		imc->ops->set_thrt_pwr(imc, dimms, thrt);
+		ret = 0;
+	}
+
+	err = uncore_imc_resume();
+	mutex_unlock(&uncore_imc_mutex);
+	return ret ? ret : err;
+}
+
+/**
+ * uncore_imc_set_target
+ * @nodeid:	NUMA node of the channels
+ * @mc:		IMC of the channels, or UNCORE_IMC_ANY
+ * @channel:	channel within @mc, or UNCORE_IMC_ANY
+ * @mbps:	target bandwidth of each channel in MB/s, 0 to stop controlling
+ * Return:	0 on success, -ENXIO if no channel matches
+ *
+ * Let the controller throttle every matched channel until it moves @mbps,
+ * reads and writes together. Demand below @mbps is not throttled. Stopping
+ * brings the channels back to full bandwidth. A later fixed threshold, from
+ * uncore_imc_set_threshold or uncore_imc_set_thrt_pwr, clears the target.
+ * Channels throttled in software have no CAS counts to close the loop with,
+ * targets on them fail with -EOPNOTSUPP.
+ */
+int uncore_imc_set_target(unsigned int nodeid, int mc, int channel,
+			  unsigned int mbps)
+{
+	struct uncore_imc *imc;
+	int ret = -ENXIO, err;
+
+	if (nodeid >= UNCORE_MAX_SOCKET)
+		return -EINVAL;
+
+	mutex_lock(&uncore_imc_mutex);
+	if (uncore_imc_calibrating) {
+		mutex_unlock(&uncore_imc_mutex);
+		return -EBUSY;
+	}
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (mbps && imc->ops->charge &&
+		    uncore_imc_match(imc, nodeid, mc, channel)) {
+			mutex_unlock(&uncore_imc_mutex);
+			return -EOPNOTSUPP;
+		}
+	}
+
+	uncore_imc_pause();
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (!uncore_imc_match(imc, nodeid, mc, channel))
+			continue;
+		if (!mbps && imc->target) {
+			imc->ops->set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS,
+					       UNCORE_IMC_THRT_PWR_MAX);
+			imc->thrt = UNCORE_IMC_THRT_PWR_MAX;
+		}
+		imc->target = mbps;
+		ret = 0;
+	}
+
+	err = uncore_imc_resume();
+	mutex_unlock(&uncore_imc_mutex);
+	return ret ? ret : err;
+}
+
+/**
+ * uncore_imc_claim
+ * @nodeid:	NUMA node to calibrate
+ * Return:	0 on success, -EBUSY if the controller is running
+ *
+ * Take CAS counters of all channels, and channels of @nodeid, for
+ * calibration. Throttle state of the channels is saved, and throttling is
+ * enabled on them. Until uncore_imc_release, the controller can not be
+ * started and fixed thresholds can not be set on @nodeid.
+ */
+int uncore_imc_claim(unsigned int nodeid)
+{
+	struct uncore_imc *imc;
+	int ret = -ENXIO;
+
+	if (nodeid >= UNCORE_MAX_SOCKET)
+		return -EINVAL;
+
+	mutex_lock(&uncore_imc_mutex);
+	if (uncore_imc_controlling || uncore_imc_calibrating) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (imc->nodeid != nodeid)
+			continue;
+		if (!imc->ops->save_thrt_pwr || !imc->ops->restore_thrt_pwr) {
+			ret = -EOPNOTSUPP;
+			goto out;
+		}
+		ret = 0;
+	}
+	if (ret)
+		goto out;
+
+	ret = uncore_imc_bind_boxes();
+	if (ret)
+		goto out;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (imc->nodeid != nodeid)
+			continue;
+		imc->ops->save_thrt_pwr(imc, imc->saved_thrt);
+		imc->ops->enable_throttle(imc);
+	}
+
+	uncore_imc_calib_nodeid = nodeid;
+	uncore_imc_calibrating = true;
+out:
+	mutex_unlock(&uncore_imc_mutex);
+	return ret;
+}
+
+/* Put back throttle state of the claimed node, and free CAS counters */
+void uncore_imc_release(void)
+{
+	struct uncore_imc *imc;
+
+	mutex_lock(&uncore_imc_mutex);
+	if (uncore_imc_calibrating) {
+		list_for_each_entry(imc, &uncore_imc_devices, next) {
+			if (imc->nodeid == uncore_imc_calib_nodeid)
+				imc->ops->restore_thrt_pwr(imc, imc->saved_thrt);
+		}
+		uncore_imc_unbind_boxes();
+		uncore_imc_calibrating = false;
+	}
+	mutex_unlock(&uncore_imc_mutex);
+}
+
+/**
+ * uncore_imc_set_calib_thrt
+ * @thrt:	raw THRT_PWR, 1 to UNCORE_IMC_THRT_PWR_MAX
+ * Return:	0 on success
+ *
+ * Write @thrt to all DIMM slots of all channels of the claimed node.
+ */
+int uncore_imc_set_calib_thrt(unsigned int thrt)
+{
+	struct uncore_imc *imc;
+	int ret = -EPERM;
+
+	if (!thrt || thrt > UNCORE_IMC_THRT_PWR_MAX)
+		return -EINVAL;
+
+	mutex_lock(&uncore_imc_mutex);
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (!uncore_imc_calib_owns(imc->nodeid))
+			continue;
+		imc->ops->set_thrt_pwr(imc, UNCORE_IMC_ALL_DIMMS, thrt);
+		ret = 0;
+	}
+	mutex_unlock(&uncore_imc_mutex);
+	return ret;
+}
+
+/**
+ * uncore_imc_read_cas
+ * @nodeid:	NUMA node to read
+ * @reads:	place to hold CAS reads since last time
+ * @writes:	place to hold CAS writes since last time
+ * Return:	channels counted, 0 if none
+ *
+ * Sum up CAS counts of all channels of @nodeid. Counters must have been
+ * claimed through uncore_imc_claim.
+ */
+unsigned int uncore_imc_read_cas(unsigned int nodeid, u64 *reads, u64 *writes)
+{
+	struct uncore_imc *imc;
+	u64 values[UNCORE_BOX_MAX_EVENTS];
+	unsigned int nr = 0;
+
+	*reads = *writes = 0;
+
+	mutex_lock(&uncore_imc_mutex);
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (!uncore_imc_calibrating)
+			break;
+		if (imc->nodeid != nodeid || !imc->box)
+			continue;
+		uncore_box_read_events(imc->box, values);
+		*reads += values[0];
+		*writes += values[1];
+		nr++;
+	}
+	mutex_unlock(&uncore_imc_mutex);
+
+	return nr;
+}
+
+/* Channels watched by the controller, for /proc/uncore_pmu */
+void uncore_imc_show_control(struct seq_file *m)
+{
+	struct uncore_imc *imc;
+
+	mutex_lock(&uncore_imc_mutex);
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (!imc->box)
+			continue;
+		seq_printf(m, "\nN%u MC%u Channel %u: Target %u MB/s, THRT_PWR 0x%03x, %llu MB/s",
+			   imc->nodeid, imc->mc, imc->channel, imc->target,
+			   imc->thrt, imc->mbps);
+	}
+	mutex_unlock(&uncore_imc_mutex);
+}
+
 void uncore_print_imc_devices(void)
 {
 	struct uncore_imc *imc;
 
 	pr_info("\033[34m------------------------ IMC Devices ----------------------\033[0m");
 	list_for_each_entry(imc, &uncore_imc_devices, next) {
-		pr_info("......Node %d, %x:%x:%x, %d:%d:%d, Kref = %d",
-		imc->nodeid,
+		if (!imc->pdev) {
+			pr_info("......Node %d, %s", imc->nodeid,
+				uncore_simulate ? "simulated" : "software");
+			continue;
+		}
+		pr_info("......Node %d, MC%u Channel %u, %x:%x:%x, %d:%d:%d, Kref = %d",
+		imc->nodeid, imc->mc, imc->channel,
 		imc->pdev->bus->number,
 		imc->pdev->vendor,
 		imc->pdev->device,
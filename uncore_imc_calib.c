@@ -0,0 +1,492 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define pr_fmt(fmt) "UNCORE CALIB: " fmt
+
+/*
+ * THRT_PWR calibration.
+ *
+ * Nobody tells how THRT_PWR relates to bandwidth, so measure it. Write
+ * "run <node>" to /proc/uncore_calib: every online cpu of the node, except
+ * those polling for the emulator, runs a STREAM-like kernel over memory of
+ * the node, while all its channels are swept through candidate THRT_PWR
+ * values. Read and write bandwidth of each value is taken from IMC CAS
+ * counts, and kept as the table of the node.
+ * Throttle state of the node is put back when the sweep is done, and the
+ * node can not be throttled by anyone else meanwhile.
+ *
+ * uncore_imc_set_threshold interpolates THRT_PWR from the table, once there
+ * is one. Tables are lost on unload, save them by reading /proc/uncore_calib
+ * and load them back by writing the same lines:
+ *
+ *	<node> <THRT_PWR> <read MB/s> <write MB/s>
+ *
+ * "clear <node>" drops the table of a node.
+ */
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <asm/uaccess.h>
+
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/delay.h>
+#include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/nodemask.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+
+static unsigned int calib_mb = 16;
+module_param(calib_mb, uint, 0444);
+MODULE_PARM_DESC(calib_mb, "Size of each array of a STREAM thread in MB (default: 16)");
+
+static unsigned int calib_window_ms = 200;
+module_param(calib_window_ms, uint, 0444);
+MODULE_PARM_DESC(calib_window_ms, "Time to measure each THRT_PWR value in ms (default: 200)");
+
+/* Time for the load to settle after THRT_PWR changes */
+#define UNCORE_CALIB_SETTLE_MS		20
+
+#define UNCORE_CALIB_MAX_POINTS		16
+
+/* Biggest blob accepted by one write */
+#define UNCORE_CALIB_MAX_WRITE		(16 * 1024)
+
+/* Roughly log-spaced, denser near the top where bandwidth saturates */
+static const u16 uncore_calib_candidates[] = {
+	0x0fff, 0x0bff, 0x07ff, 0x05ff, 0x03ff, 0x02ff, 0x01ff,
+	0x017f, 0x00ff, 0x00bf, 0x007f, 0x003f, 0x001f, 0x000f,
+};
+
+/**
+ * struct uncore_calib_point
+ * @thrt:	THRT_PWR of all channels of the node
+ * @rd_mbps:	read bandwidth of the node achieved at @thrt
+ * @wr_mbps:	write bandwidth of the node achieved at @thrt
+ */
+struct uncore_calib_point {
+	unsigned int	thrt;
+	u64		rd_mbps;
+	u64		wr_mbps;
+};
+
+/**
+ * struct uncore_calib_table
+ * @nr:		valid entries of @points
+ * @points:	sorted by THRT_PWR, ascending
+ */
+struct uncore_calib_table {
+	unsigned int			nr;
+	struct uncore_calib_point	points[UNCORE_CALIB_MAX_POINTS];
+};
+
+/**
+ * struct uncore_calib_load
+ * @task:	kthread bound to a cpu of the node
+ * @a:		array read
+ * @b:		array read and written
+ * @nr:		elements of each array
+ */
+struct uncore_calib_load {
+	struct task_struct	*task;
+	u64			*a;
+	u64			*b;
+	size_t			nr;
+};
+
+static struct uncore_calib_table uncore_calib[UNCORE_MAX_SOCKET];
+static DEFINE_MUTEX(uncore_calib_mutex);
+
+static inline u64 uncore_calib_total(const struct uncore_calib_point *pt)
+{
+	return pt->rd_mbps + pt->wr_mbps;
+}
+
+/* Add @pt to @table, replacing the point of the same THRT_PWR if any */
+static int uncore_calib_insert(struct uncore_calib_table *table,
+			       const struct uncore_calib_point *pt)
+{
+	unsigned int i;
+
+	for (i = 0; i < table->nr; i++) {
+		if (table->points[i].thrt == pt->thrt) {
+			table->points[i] = *pt;
+			return 0;
+		}
+		if (table->points[i].thrt > pt->thrt)
+			break;
+	}
+
+	if (table->nr == UNCORE_CALIB_MAX_POINTS)
+		return -ENOSPC;
+
+	memmove(&table->points[i + 1], &table->points[i],
+		(table->nr - i) * sizeof(*pt));
+	table->points[i] = *pt;
+	table->nr++;
+	return 0;
+}
+
+/**
+ * uncore_calib_thrt
+ * @nodeid:	NUMA node to throttle
+ * @threshold:	1/(threshold) of full bandwidth
+ * Return:	THRT_PWR for it, 0 if @nodeid is not calibrated
+ *
+ * Full bandwidth is the one measured at the highest THRT_PWR. Between two
+ * measured points, THRT_PWR is linearly interpolated. Below the lowest one
+ * there is nothing better than the lowest THRT_PWR.
+ */
+unsigned int uncore_calib_thrt(unsigned int nodeid, unsigned int threshold)
+{
+	struct uncore_calib_table *table;
+	struct uncore_calib_point *lo, *hi;
+	unsigned int i, thrt = 0;
+	u64 want;
+
+	if (nodeid >= UNCORE_MAX_SOCKET || !threshold)
+		return 0;
+
+	mutex_lock(&uncore_calib_mutex);
+	table = &uncore_calib[nodeid];
+	if (table->nr < 2)
+		goto out;
+
+	if (threshold == 1) {
+		thrt = UNCORE_IMC_THRT_PWR_MAX;
+		goto out;
+	}
+
+	want = div_u64(uncore_calib_total(&table->points[table->nr - 1]),
+		       threshold);
+
+	thrt = table->points[table->nr - 1].thrt;
+	for (i = 0; i < table->nr - 1; i++) {
+		lo = &table->points[i];
+		hi = &table->points[i + 1];
+		if (uncore_calib_total(hi) < want)
+			continue;
+
+		if (uncore_calib_total(lo) >= want) {
+			thrt = lo->thrt;
+			break;
+		}
+		thrt = lo->thrt + div64_u64((u64)(hi->thrt - lo->thrt) *
+				(want - uncore_calib_total(lo)),
+				uncore_calib_total(hi) - uncore_calib_total(lo));
+		break;
+	}
+
+out:
+	mutex_unlock(&uncore_calib_mutex);
+	return thrt;
+}
+
+/*
+ * STREAM Add, more or less. It is b += a rather than c = a + b, so the
+ * compiler can not turn it into memcpy. Every pass reads both arrays and
+ * writes one back.
+ */
+static int uncore_calib_stream(void *data)
+{
+	struct uncore_calib_load *load = data;
+	size_t i;
+
+	while (!kthread_should_stop()) {
+		for (i = 0; i < load->nr; i++)
+			load->b[i] += load->a[i];
+		cond_resched();
+	}
+	return 0;
+}
+
+static void uncore_calib_stop_loads(struct uncore_calib_load *loads, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (loads[i].task)
+			kthread_stop(loads[i].task);
+		vfree(loads[i].a);
+		vfree(loads[i].b);
+	}
+}
+
+/*
+ * Start a STREAM thread on every online cpu of @nodeid, return how many.
+ * Polling cpus of the emulator are left alone, a load there would delay
+ * polling and distort emulation while the sweep runs.
+ */
+static int uncore_calib_start_loads(unsigned int nodeid,
+				    struct uncore_calib_load *loads)
+{
+	size_t bytes = (size_t)calib_mb << 20;
+	cpumask_var_t cpus;
+	int cpu, nr = 0;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	emulate_nvm_polling_cpus(cpus);
+	cpumask_andnot(cpus, cpumask_of_node(nodeid), cpus);
+	cpumask_and(cpus, cpus, cpu_online_mask);
+
+	for_each_cpu(cpu, cpus) {
+		loads[nr].a = vzalloc_node(bytes, nodeid);
+		loads[nr].b = vzalloc_node(bytes, nodeid);
+		loads[nr].nr = bytes / sizeof(u64);
+		if (!loads[nr].a || !loads[nr].b)
+			goto fail;
+
+		loads[nr].task = kthread_create_on_node(uncore_calib_stream,
+					&loads[nr], nodeid, "uncore_calib/%d", cpu);
+		if (IS_ERR(loads[nr].task)) {
+			loads[nr].task = NULL;
+			goto fail;
+		}
+		kthread_bind(loads[nr].task, cpu);
+		wake_up_process(loads[nr].task);
+		nr++;
+	}
+
+	free_cpumask_var(cpus);
+	if (!nr)
+		return -ENODEV;
+	return nr;
+
+fail:
+	free_cpumask_var(cpus);
+	uncore_calib_stop_loads(loads, nr + 1);
+	return -ENOMEM;
+}
+
+/* Measure bandwidth of @nodeid with all its channels at @thrt */
+static int uncore_calib_point(unsigned int nodeid, unsigned int thrt,
+			      struct uncore_calib_point *pt)
+{
+	u64 reads, writes, start, ns;
+	int ret;
+
+	ret = uncore_imc_set_calib_thrt(thrt);
+	if (ret)
+		return ret;
+
+	msleep(UNCORE_CALIB_SETTLE_MS);
+	uncore_imc_read_cas(nodeid, &reads, &writes);
+	start = ktime_get_ns();
+
+	msleep(calib_window_ms);
+	if (!uncore_imc_read_cas(nodeid, &reads, &writes))
+		return -ENODEV;
+	ns = ktime_get_ns() - start;
+
+	pt->thrt = thrt;
+	pt->rd_mbps = div64_u64(reads * UNCORE_IMC_CAS_BYTES * 1000, ns);
+	pt->wr_mbps = div64_u64(writes * UNCORE_IMC_CAS_BYTES * 1000, ns);
+
+	pr_info("Node %u, THRT_PWR 0x%03x: read %llu MB/s, write %llu MB/s",
+		nodeid, thrt, pt->rd_mbps, pt->wr_mbps);
+	return 0;
+}
+
+/*
+ * Sweep all candidates on @nodeid. Throttle state of the node, e.g. set up
+ * by the emulator, is put back afterwards. Its old table stays if anything
+ * fails.
+ */
+static int uncore_calib_run(unsigned int nodeid)
+{
+	struct uncore_calib_table *table;
+	struct uncore_calib_point pt;
+	struct uncore_calib_load *loads;
+	int i, nr_loads, ret;
+
+	if (nodeid >= UNCORE_MAX_SOCKET || !node_online(nodeid) ||
+	    !calib_mb || !calib_window_ms)
+		return -EINVAL;
+
+	table = kzalloc(sizeof(*table), GFP_KERNEL);
+	loads = kcalloc(nr_cpu_ids, sizeof(*loads), GFP_KERNEL);
+	if (!table || !loads) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	ret = uncore_imc_claim(nodeid);
+	if (ret)
+		goto free;
+
+	nr_loads = uncore_calib_start_loads(nodeid, loads);
+	if (nr_loads < 0) {
+		ret = nr_loads;
+		goto release;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(uncore_calib_candidates); i++) {
+		ret = uncore_calib_point(nodeid, uncore_calib_candidates[i], &pt);
+		if (ret)
+			break;
+		uncore_calib_insert(table, &pt);
+	}
+
+	uncore_calib_stop_loads(loads, nr_loads);
+
+	if (!ret) {
+		mutex_lock(&uncore_calib_mutex);
+		uncore_calib[nodeid] = *table;
+		mutex_unlock(&uncore_calib_mutex);
+	}
+
+release:
+	uncore_imc_release();
+free:
+	kfree(loads);
+	kfree(table);
+	return ret;
+}
+
+static int uncore_calib_parse(char *line)
+{
+	struct uncore_calib_point pt;
+	unsigned int node;
+	int ret;
+
+	if (sscanf(line, "run %u", &node) == 1)
+		return uncore_calib_run(node);
+
+	if (sscanf(line, "clear %u", &node) == 1) {
+		if (node >= UNCORE_MAX_SOCKET)
+			return -EINVAL;
+		mutex_lock(&uncore_calib_mutex);
+		uncore_calib[node].nr = 0;
+		mutex_unlock(&uncore_calib_mutex);
+		return 0;
+	}
+
+	if (sscanf(line, "%u %i %llu %llu", &node, &pt.thrt,
+		   &pt.rd_mbps, &pt.wr_mbps) != 4)
+		return -EINVAL;
+	if (node >= UNCORE_MAX_SOCKET || !pt.thrt ||
+	    pt.thrt > UNCORE_IMC_THRT_PWR_MAX)
+		return -EINVAL;
+
+	mutex_lock(&uncore_calib_mutex);
+	ret = uncore_calib_insert(&uncore_calib[node], &pt);
+	mutex_unlock(&uncore_calib_mutex);
+	return ret;
+}
+
+static int uncore_calib_proc_show(struct seq_file *m, void *v)
+{
+	struct uncore_calib_point *pt;
+	unsigned int node, i;
+
+	seq_printf(m, "# node THRT_PWR read_mbps write_mbps\n");
+
+	mutex_lock(&uncore_calib_mutex);
+	for (node = 0; node < UNCORE_MAX_SOCKET; node++) {
+		for (i = 0; i < uncore_calib[node].nr; i++) {
+			pt = &uncore_calib[node].points[i];
+			seq_printf(m, "%u 0x%03x %llu %llu\n",
+				node, pt->thrt, pt->rd_mbps, pt->wr_mbps);
+		}
+	}
+	mutex_unlock(&uncore_calib_mutex);
+
+	return 0;
+}
+
+static int uncore_calib_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, uncore_calib_proc_show, NULL);
+}
+
+/*
+ * One command or table point per line. Empty lines and lines starting
+ * with '#' are skipped. Stop at the first bad line, lines before stay.
+ */
+static ssize_t uncore_calib_proc_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *offs)
+{
+	char *blob, *line, *p;
+	int ret = 0;
+
+	if (!count || count > UNCORE_CALIB_MAX_WRITE)
+		return -EINVAL;
+
+	blob = kmalloc(count + 1, GFP_KERNEL);
+	if (!blob)
+		return -ENOMEM;
+
+	if (copy_from_user(blob, buf, count)) {
+		kfree(blob);
+		return -EFAULT;
+	}
+	blob[count] = '\0';
+
+	p = blob;
+	while (!ret && (line = strsep(&p, "\n"))) {
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+
+		ret = uncore_calib_parse(line);
+		if (ret)
+			pr_err("Bad line: %s", line);
+	}
+
+	kfree(blob);
+	return ret ? ret : count;
+}
+
+static const struct file_operations uncore_calib_proc_fops = {
+	.open		= uncore_calib_proc_open,
+	.read		= seq_read,
+	.write		= uncore_calib_proc_write,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+static bool is_proc_registed = false;
+
+int uncore_calib_init(void)
+{
+	if (!proc_create("uncore_calib", 0644, NULL, &uncore_calib_proc_fops))
+		return -ENOENT;
+
+	is_proc_registed = true;
+	return 0;
+}
+
+void uncore_calib_exit(void)
+{
+	if (is_proc_registed) {
+		remove_proc_entry("uncore_calib", NULL);
+		is_proc_registed = false;
+	}
+}
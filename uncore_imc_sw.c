@@ -0,0 +1,223 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define pr_fmt(fmt) "UNCORE IMC SW: " fmt
+
+/*
+ * Software IMC, for platforms whose IMC can not be throttled.
+ *
+ * One software IMC per node, with a token bucket instead of THRT_PWR. Bytes
+ * fill the bucket at the throttled rate, which is the peak rate of the node
+ * times THRT_PWR/0xfff, just like the simulated IMC. Nothing is slowed down
+ * by hardware: whoever consumes bandwidth reports it through
+ * uncore_imc_charge, and gets back how long consumers have to stall to stay
+ * within the rate. Callers of uncore_imc_set_threshold can not tell.
+ */
+
+#include "uncore_pmu.h"
+
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/nodemask.h>
+#include <linux/spinlock.h>
+#include <linux/moduleparam.h>
+
+static unsigned long sw_peak_mbps = 51200;
+module_param(sw_peak_mbps, ulong, 0444);
+MODULE_PARM_DESC(sw_peak_mbps, "Unthrottled bandwidth of a node for software throttling in MB/s (default: 51200)");
+
+/* Bursts up to this long pass at full speed */
+#define SW_IMC_BURST_NS		(100 * NSEC_PER_USEC)
+
+/**
+ * struct sw_imc
+ * @imc:		the generic imc, must be the first member
+ * @lock:		protects all below, pollers and /proc race for it
+ * @thrt:		THRT_PWR the node is throttled to
+ * @enabled:		throttling is enabled
+ * @tokens:		bytes which may pass without stall, negative if owed
+ * @last_ns:		when @tokens was filled last time
+ */
+struct sw_imc {
+	struct uncore_imc	imc;
+	spinlock_t		lock;
+	unsigned int		thrt;
+	bool			enabled;
+	s64			tokens;
+	u64			last_ns;
+};
+
+static inline struct sw_imc *to_sw_imc(struct uncore_imc *imc)
+{
+	return container_of(imc, struct sw_imc, imc);
+}
+
+/* Throttled rate in MB/s, which is bytes per us, 0 if not throttled */
+static u64 sw_imc_rate(struct sw_imc *si)
+{
+	if (!si->enabled || si->thrt >= UNCORE_IMC_THRT_PWR_MAX)
+		return 0;
+	return max_t(u64, div_u64((u64)sw_peak_mbps * si->thrt,
+				  UNCORE_IMC_THRT_PWR_MAX), 1);
+}
+
+/* Fill the bucket up to now, called with lock held */
+static void sw_imc_fill(struct sw_imc *si, u64 rate)
+{
+	u64 now, dt;
+	s64 depth;
+
+	now = ktime_get_ns();
+	dt = now - si->last_ns;
+	si->last_ns = now;
+
+	depth = div_u64(rate * SW_IMC_BURST_NS, NSEC_PER_USEC);
+	si->tokens = min_t(s64, si->tokens + div_u64(rate * dt, NSEC_PER_USEC),
+			   depth);
+}
+
+/* Rate changes start from a full bucket, debts of the old rate are gone */
+static void sw_imc_reset(struct sw_imc *si)
+{
+	si->last_ns = ktime_get_ns();
+	si->tokens = div_u64(sw_imc_rate(si) * SW_IMC_BURST_NS, NSEC_PER_USEC);
+}
+
+static int sw_imc_set_threshold(struct uncore_imc *imc, unsigned int threshold)
+{
+	struct sw_imc *si = to_sw_imc(imc);
+	unsigned long flags;
+
+	if (!threshold)
+		return -EINVAL;
+
+	spin_lock_irqsave(&si->lock, flags);
+	si->thrt = UNCORE_IMC_THRT_PWR_MAX / threshold;
+	sw_imc_reset(si);
+	spin_unlock_irqrestore(&si->lock, flags);
+	return 0;
+}
+
+/* There are no DIMMs, any of them throttles the whole node */
+static void sw_imc_set_thrt_pwr(struct uncore_imc *imc, unsigned int dimms,
+				unsigned int thrt)
+{
+	struct sw_imc *si = to_sw_imc(imc);
+	unsigned long flags;
+
+	if (!dimms)
+		return;
+
+	spin_lock_irqsave(&si->lock, flags);
+	si->thrt = thrt & UNCORE_IMC_THRT_PWR_MAX;
+	sw_imc_reset(si);
+	spin_unlock_irqrestore(&si->lock, flags);
+}
+
+static int sw_imc_enable_throttle(struct uncore_imc *imc)
+{
+	struct sw_imc *si = to_sw_imc(imc);
+	unsigned long flags;
+
+	spin_lock_irqsave(&si->lock, flags);
+	si->enabled = true;
+	sw_imc_reset(si);
+	spin_unlock_irqrestore(&si->lock, flags);
+	return 0;
+}
+
+static void sw_imc_disable_throttle(struct uncore_imc *imc)
+{
+	struct sw_imc *si = to_sw_imc(imc);
+	unsigned long flags;
+
+	spin_lock_irqsave(&si->lock, flags);
+	si->enabled = false;
+	spin_unlock_irqrestore(&si->lock, flags);
+}
+
+/*
+ * Take @bytes out of the bucket. Return the stall which pays for what went
+ * below zero this time. Debts charged before are paid by time passing, they
+ * are not charged again.
+ */
+static u64 sw_imc_charge(struct uncore_imc *imc, u64 bytes)
+{
+	struct sw_imc *si = to_sw_imc(imc);
+	unsigned long flags;
+	s64 before, after;
+	u64 rate, stall = 0;
+
+	spin_lock_irqsave(&si->lock, flags);
+	rate = sw_imc_rate(si);
+	if (rate) {
+		sw_imc_fill(si, rate);
+		before = min_t(s64, si->tokens, 0);
+		si->tokens -= bytes;
+		after = min_t(s64, si->tokens, 0);
+		stall = div64_u64((before - after) * NSEC_PER_USEC, rate);
+	}
+	spin_unlock_irqrestore(&si->lock, flags);
+
+	return stall;
+}
+
+static const struct uncore_imc_ops SW_IMC_OPS = {
+	.set_threshold		= sw_imc_set_threshold,
+	.set_thrt_pwr		= sw_imc_set_thrt_pwr,
+	.enable_throttle	= sw_imc_enable_throttle,
+	.disable_throttle	= sw_imc_disable_throttle,
+	.charge			= sw_imc_charge
+};
+
+/*
+ * IMCs are freed by uncore_imc_exit, also if we fail halfway here.
+ */
+int sw_imc_init(void)
+{
+	struct sw_imc *si;
+	unsigned int node;
+
+	if (!sw_peak_mbps)
+		return -EINVAL;
+
+	uncore_imc_device_ids = NULL;
+	uncore_imc_ops = &SW_IMC_OPS;
+
+	for_each_online_node(node) {
+		if (node >= UNCORE_MAX_SOCKET)
+			break;
+
+		si = kzalloc_node(sizeof(struct sw_imc), GFP_KERNEL, node);
+		if (!si)
+			return -ENOMEM;
+
+		spin_lock_init(&si->lock);
+		si->thrt = UNCORE_IMC_THRT_PWR_MAX;
+
+		si->imc.nodeid = node;
+		si->imc.ops = &SW_IMC_OPS;
+		list_add_tail(&si->imc.next, &uncore_imc_devices);
+	}
+
+	pr_info("Software throttling, %lu MB/s per node unthrottled", sw_peak_mbps);
+	return 0;
+}
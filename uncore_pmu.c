@@ -38,8 +38,11 @@
 
 #include <asm/setup.h>
 
+#include <linux/io.h>
 #include <linux/pci.h>
+#include <linux/acpi.h>
 #include <linux/slab.h>
+#include <linux/sched.h>
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/delay.h>
@@ -48,14 +51,38 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/hrtimer.h>
+#include <linux/moduleparam.h>
 #include <linux/cpumask.h>
+#include <linux/version.h>
 
 /*
  * This is the top description of whole system uncore pmu resources.
  */
 struct uncore_pmu uncore_pmu;
 
-unsigned int uncore_pcibus_to_nodeid[256] = { [0 ... 255] = -1, };
+/*
+ * Run on simulated boxes instead of real hardware, see uncore_sim.c
+ * Whatever the cpu is, load with simulate=1 to exercise the emulator.
+ */
+bool uncore_simulate;
+module_param_named(simulate, uncore_simulate, bool, 0444);
+MODULE_PARM_DESC(simulate, "Use simulated uncore boxes (default: 0)");
+
+/* Bumped whenever the event group of any box changes, see uncore_snapshot */
+atomic_t uncore_box_events_gen = ATOMIC_INIT(0);
+
+/*
+ * Map config space of PCI type boxes through MMCONFIG (ECAM), see
+ * uncore_pci_ioremap. Load with ecam=0 to use pci_read_config_* only.
+ */
+static bool uncore_ecam = true;
+module_param_named(ecam, uncore_ecam, bool, 0444);
+MODULE_PARM_DESC(ecam, "Access PCI box counters through ECAM (default: 1)");
+
+/* PCI bus to NUMA node, indexed by [segment][bus], see uncore_pcibus_to_nodeid */
+int uncore_pci_bus_node[UNCORE_MAX_PCI_SEGMENT][256] = {
+	[0 ... UNCORE_MAX_PCI_SEGMENT - 1] = { [0 ... 255] = -1 }
+};
 
 struct uncore_box_type *dummy_xxx_type[] = { NULL, };
 struct uncore_box_type **uncore_msr_type = dummy_xxx_type;
@@ -88,7 +115,7 @@ int first_online_cpu_of_node(unsigned int node)
 	mask = cpumask_of_node(node);
 	cpu = cpumask_first(mask);
 
-	if (cpu > nr_cpu_ids)
+	if (cpu >= nr_cpu_ids)
 		cpu = -1;
 	
 	return cpu;
@@ -109,7 +136,7 @@ int uncore_call_function_on_node(unsigned int node,
 {
 	int cpu, err;
 
-	if (node > nr_node_ids || !func)
+	if (node >= nr_node_ids || !func)
 		return -EINVAL;
 
 	cpu = first_online_cpu_of_node(node);
@@ -121,6 +148,88 @@ int uncore_call_function_on_node(unsigned int node,
 	return err;
 }
 
+static void __uncore_box_call(void *info)
+{
+	struct uncore_box_call *call = info;
+	struct uncore_box *box = call->box;
+	const struct uncore_box_ops *ops = box->box_type->ops;
+
+	switch (call->op) {
+	case UNCORE_BOX_SHOW:
+		if (ops->show_box)
+			ops->show_box(box);
+		break;
+	case UNCORE_BOX_INIT:
+		if (ops->init_box)
+			ops->init_box(box);
+		break;
+	case UNCORE_BOX_CLEAR:
+		if (ops->clear_box)
+			ops->clear_box(box);
+		break;
+	case UNCORE_BOX_ENABLE:
+		if (ops->enable_box)
+			ops->enable_box(box);
+		break;
+	case UNCORE_BOX_DISABLE:
+		if (ops->disable_box)
+			ops->disable_box(box);
+		break;
+	case UNCORE_BOX_ENABLE_EVENT:
+		if (ops->enable_event)
+			ops->enable_event(box, call->idx, call->event);
+		break;
+	case UNCORE_BOX_DISABLE_EVENT:
+		if (ops->disable_event)
+			ops->disable_event(box, call->idx, call->event);
+		break;
+	case UNCORE_BOX_WRITE_COUNTER:
+		if (ops->write_counter)
+			ops->write_counter(box, call->idx, call->value);
+		break;
+	case UNCORE_BOX_READ_COUNTER:
+		if (ops->read_counter)
+			ops->read_counter(box, call->idx, call->valuep);
+		break;
+	case UNCORE_BOX_WRITE_FILTER:
+		if (ops->write_filter)
+			ops->write_filter(box, call->value);
+		break;
+	case UNCORE_BOX_READ_FILTER:
+		if (ops->read_filter)
+			ops->read_filter(box, call->valuep);
+		break;
+	}
+}
+
+/**
+ * uncore_box_call_on_node
+ * @call:	the method and its arguments
+ *
+ * Run a method of an MSR type box on a cpu of its socket. Run in place if
+ * we are already there, which is the case for per-socket pollers, otherwise
+ * send an IPI and wait. The IPI is not allowed with irqs disabled, then the
+ * method is dropped, and reads return 0.
+ */
+void uncore_box_call_on_node(struct uncore_box_call *call)
+{
+	int cpu;
+
+	cpu = get_cpu();
+	if (cpu_to_node(cpu) == call->box->nodeid) {
+		__uncore_box_call(call);
+		put_cpu();
+		return;
+	}
+	put_cpu();
+
+	if (WARN_ON_ONCE(irqs_disabled()) ||
+	    uncore_call_function_on_node(call->box->nodeid, __uncore_box_call, call, 1)) {
+		if (call->valuep)
+			*call->valuep = 0;
+	}
+}
+
 /*
  * This is the default hrtimer function.
  */
@@ -175,32 +284,91 @@ void uncore_box_change_duration(struct uncore_box *box, u64 new)
 	box->hrtimer_duration = new;
 }
 
+/**
+ * uncore_alloc_box
+ * @size:	size of the box, could be a backend structure embedding it
+ * @nodeid:	NUMA node of the box
+ * Return:	%NULL on failure
+ *
+ * Allocate a zeroed box on its own node, so its poller never goes across
+ * QPI to touch it. Fall back to any node if @nodeid has no memory.
+ */
+void *uncore_alloc_box(size_t size, unsigned int nodeid)
+{
+	int node = NUMA_NO_NODE;
+
+	if (nodeid < MAX_NUMNODES && node_state(nodeid, N_MEMORY))
+		node = nodeid;
+
+	return kzalloc_node(size, GFP_KERNEL, node);
+}
+
+/**
+ * uncore_add_box
+ * @box:	zeroed box, could be embedded in a backend structure
+ * @type:	the box_type of new box
+ * @idx:	idx of the box within @nodeid
+ * @nodeid:	NUMA node of the box
+ * Return:	Non-zero on failure
+ *
+ * Initialize the generic part of a new box, insert it into the tail of
+ * box_list of its uncore_box_type, and into the boxes table of the type.
+ * Boxes are kfree'd on exit, so an embedded box must be the first member
+ * of its container.
+ */
+int __must_check uncore_add_box(struct uncore_box *box,
+				struct uncore_box_type *type,
+				unsigned int idx, unsigned int nodeid)
+{
+	if (nodeid >= UNCORE_MAX_SOCKET || idx >= UNCORE_MAX_BOXES)
+		return -EINVAL;
+	if (type->boxes[nodeid][idx])
+		return -EEXIST;
+
+	uncore_box_init_hrtimer(box, uncore_box_hrtimer_def);
+	box->hrtimer_duration = UNCORE_PMU_HRTIMER_INTERVAL;
+	box->idx = idx;
+	box->nodeid = nodeid;
+	box->box_type = type;
+	list_add_tail(&box->next, &type->box_list);
+	type->boxes[nodeid][idx] = box;
+
+	return 0;
+}
+
+/**
+ * uncore_del_box
+ * @box:	the box to delete
+ *
+ * Remove @box from its box_type, the caller frees it.
+ */
+void uncore_del_box(struct uncore_box *box)
+{
+	struct uncore_box_type *type = box->box_type;
+
+	list_del(&box->next);
+	type->boxes[box->nodeid][box->idx] = NULL;
+}
+
 /**
  * uncore_get_box
  * @type:	pointer to box_type
- * @idx:	idx of the box in this box_type
+ * @idx:	idx of the box within @nodeid
  * @nodeid:	which NUMA node to get this box
  * Return:	%NULL on failure
  *
  * Get a uncore PMU box to perform tasks. Note that each box of its type has
- * its dedicated idx number, and belongs to a specific NUMA node. Therefore, to
- * get a PMU box you have to offer all these three parameters. Besides, you can
- * see the idx information after print_boxes.
+ * its dedicated idx number within a node, and belongs to a specific NUMA node.
+ * Therefore, to get a PMU box you have to offer all these three parameters.
+ * Besides, you can see the idx information after print_boxes.
  */
 struct uncore_box *uncore_get_box(struct uncore_box_type *type,
 				  unsigned int idx, unsigned int nodeid)
 {
-	struct uncore_box *box;
-
-	if (!type || idx < 0 || nodeid > UNCORE_MAX_SOCKET)
+	if (!type || idx >= UNCORE_MAX_BOXES || nodeid >= UNCORE_MAX_SOCKET)
 		return NULL;
 
-	list_for_each_entry(box, &type->box_list, next) {
-		if (box->idx == idx && box->nodeid == nodeid)
-			return box;
-	}
-
-	return NULL;
+	return type->boxes[nodeid][idx];
 }
 
 /**
@@ -209,26 +377,203 @@ struct uncore_box *uncore_get_box(struct uncore_box_type *type,
  * @nodeid:	which NUMA node to get this box
  * Return:	%NULL on failure
  *
- * Get the first box in the box_type list of @nodeid node. We have this
- * function because some box types only have one avaliable box within a node.
+ * Get the box with the lowest idx of @nodeid node. We have this function
+ * because some box types only have one avaliable box within a node.
  * It is more convenient to get box without an idx. (I know...)
  */
 struct uncore_box *uncore_get_first_box(struct uncore_box_type *type,
 					unsigned int nodeid)
 {
-	struct uncore_box *box;
+	unsigned int idx;
 
-	if (!type || nodeid > UNCORE_MAX_SOCKET)
+	if (!type || nodeid >= UNCORE_MAX_SOCKET)
 		return NULL;
 
-	list_for_each_entry(box, &type->box_list, next) {
-		if (box->nodeid == nodeid)
-			return box;
+	for (idx = 0; idx < UNCORE_MAX_BOXES; idx++) {
+		if (type->boxes[nodeid][idx])
+			return type->boxes[nodeid][idx];
 	}
 
 	return NULL;
 }
 
+/**
+ * uncore_box_add_event
+ * @box:	the box to count @event
+ * @event:	the event to add into group of @box
+ * Return:	counter assigned to @event, negative on failure
+ *
+ * Add @event to the event group of @box, and program the first free counter
+ * which is able to count it. Events are assigned in order, so the order they
+ * are added decides which counter they get. This method will *NOT* start
+ * counting, call uncore_enable_box to start.
+ */
+int __must_check uncore_box_add_event(struct uncore_box *box,
+				      struct uncore_event *event)
+{
+	unsigned int idx, num_counters;
+
+	if (!box || !event)
+		return -EINVAL;
+
+	num_counters = min_t(unsigned int, box->box_type->num_counters,
+			     UNCORE_BOX_MAX_EVENTS);
+
+	for (idx = 0; idx < num_counters; idx++) {
+		if (box->events[idx])
+			continue;
+		if (event->counters && !(event->counters & (1U << idx)))
+			continue;
+
+		box->events[idx] = event;
+		box->num_events++;
+		box->last_values[idx] = 0;
+		if (event->filter)
+			uncore_write_filter(box, event->filter);
+		uncore_write_counter(box, idx, 0);
+		uncore_enable_event(box, idx, event);
+		atomic_inc(&uncore_box_events_gen);
+		return idx;
+	}
+
+	return -ENOSPC;
+}
+
+/**
+ * uncore_box_replace_event
+ * @box:	the box in question
+ * @idx:	counter of an event in the group of @box
+ * @event:	the new event to count
+ * Return:	Non-zero on failure
+ *
+ * Let counter @idx count @event instead, while the rest of the group keeps
+ * counting. The next uncore_box_read_events returns counts of @event since
+ * now. Must not race with reads of @box, call it from the poller.
+ */
+int uncore_box_replace_event(struct uncore_box *box, unsigned int idx,
+			     struct uncore_event *event)
+{
+	if (idx >= UNCORE_BOX_MAX_EVENTS || !box->events[idx] || !event)
+		return -EINVAL;
+	if (event->counters && !(event->counters & (1U << idx)))
+		return -EINVAL;
+
+	uncore_disable_event(box, idx, box->events[idx]);
+	box->events[idx] = event;
+	box->last_values[idx] = 0;
+	if (event->filter)
+		uncore_write_filter(box, event->filter);
+	uncore_write_counter(box, idx, 0);
+	uncore_enable_event(box, idx, event);
+	atomic_inc(&uncore_box_events_gen);
+
+	return 0;
+}
+
+/**
+ * uncore_box_del_events
+ * @box:	the box in question
+ *
+ * Disable all events in the group of @box, and empty the group.
+ */
+void uncore_box_del_events(struct uncore_box *box)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < UNCORE_BOX_MAX_EVENTS; idx++) {
+		if (!box->events[idx])
+			continue;
+		uncore_disable_event(box, idx, box->events[idx]);
+		box->events[idx] = NULL;
+	}
+	box->num_events = 0;
+	atomic_inc(&uncore_box_events_gen);
+}
+
+/* Reads timed with interrupts off in one go, a few us at most */
+#define UNCORE_BENCH_BATCH	32
+
+/*
+ * Time @loops reads of counter 0 of @box through @io_addr, NULL for pci_ops.
+ * Interrupts are only off within a batch, and the cpu may be rescheduled
+ * between batches, so this does not hold up a polling cpu for long.
+ */
+static u64 uncore_box_bench_batches(struct uncore_box *box,
+				    void __iomem *io_addr, unsigned int loops)
+{
+	void __iomem *saved = box->io_addr;
+	unsigned long flags;
+	unsigned int i, n;
+	u64 start, value, ns = 0;
+
+	while (loops) {
+		n = min_t(unsigned int, loops, UNCORE_BENCH_BATCH);
+		loops -= n;
+
+		local_irq_save(flags);
+		WRITE_ONCE(box->io_addr, io_addr);
+		start = ktime_get_ns();
+		for (i = 0; i < n; i++)
+			uncore_read_counter(box, 0, &value);
+		ns += ktime_get_ns() - start;
+		WRITE_ONCE(box->io_addr, saved);
+		local_irq_restore(flags);
+
+		cond_resched();
+	}
+	return ns;
+}
+
+/**
+ * uncore_box_bench_read
+ * @box:	PCI type box to read
+ * @loops:	reads of each access path
+ * @ecam_ns:	place to hold average ns per counter read through ECAM
+ * @cfg_ns:	place to hold average ns per counter read through pci_ops
+ * Return:	Non-zero if @box has no ECAM mapping
+ *
+ * Time uncore_read_counter of counter 0 of @box, with and without ECAM. Reads
+ * have no side effect, so it is fine to run while the box is being polled.
+ * It may sleep.
+ */
+int uncore_box_bench_read(struct uncore_box *box, unsigned int loops,
+			  u64 *ecam_ns, u64 *cfg_ns)
+{
+	void __iomem *io_addr = box->io_addr;
+
+	if (!io_addr || !loops)
+		return -ENODEV;
+
+	*ecam_ns = div_u64(uncore_box_bench_batches(box, io_addr, loops), loops);
+	*cfg_ns = div_u64(uncore_box_bench_batches(box, NULL, loops), loops);
+	return 0;
+}
+
+/**
+ * uncore_box_read_events
+ * @box:	the box to read
+ * @values:	place to hold counts, indexed by counter
+ *
+ * Read all counters of the event group of @box, and return counts since the
+ * last read. Counters keep running, nothing is frozen or written, so this
+ * costs only the reads. Epochs must be shorter than a counter takes to wrap,
+ * which is hours for 48-bit counters. @values must have UNCORE_BOX_MAX_EVENTS
+ * slots, slots of unused counters are left untouched.
+ */
+void uncore_box_read_events(struct uncore_box *box, u64 *values)
+{
+	unsigned int idx;
+	u64 now;
+
+	for (idx = 0; idx < UNCORE_BOX_MAX_EVENTS; idx++) {
+		if (!box->events[idx])
+			continue;
+		uncore_read_counter(box, idx, &now);
+		values[idx] = uncore_box_ctr_delta(box, box->last_values[idx], now);
+		box->last_values[idx] = now;
+	}
+}
+
 static void __uncore_clear_global_pmu(void *info)
 {
 	unsigned int status;
@@ -266,6 +611,117 @@ void uncore_clear_global_pmu(struct uncore_pmu *pmu)
 	}
 }
 
+/**
+ * uncore_snapshot_init
+ * @snap:	the snapshot to set up
+ * @nodeid:	NUMA node to take snapshots of
+ * Return:	Non-zero on failure
+ *
+ * Collect all boxes of @nodeid which have an event group. Call it again if
+ * event groups change.
+ */
+int uncore_snapshot_init(struct uncore_snapshot *snap, unsigned int nodeid)
+{
+	struct uncore_box_type **types[] = { uncore_pci_type, uncore_msr_type };
+	struct uncore_box *box;
+	unsigned int idx;
+	int i, t;
+
+	if (nodeid >= UNCORE_MAX_SOCKET)
+		return -EINVAL;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->nodeid = nodeid;
+	snap->gen = atomic_read(&uncore_box_events_gen);
+
+	for (t = 0; t < ARRAY_SIZE(types); t++) {
+		for (i = 0; types[t][i]; i++) {
+			for (idx = 0; idx < UNCORE_MAX_BOXES; idx++) {
+				box = types[t][i]->boxes[nodeid][idx];
+				if (!box || !box->num_events)
+					continue;
+				if (snap->nr_boxes == UNCORE_SNAPSHOT_MAX_BOXES)
+					return -ENOSPC;
+				snap->boxes[snap->nr_boxes++] = box;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * uncore_snapshot_read
+ * @snap:	the snapshot to refresh
+ *
+ * Freeze every box of the socket with one write to the global control MSR,
+ * read all bound counters in one batch, and un-freeze. Counts of all boxes
+ * then come from the same instant, at the cost of one freeze per socket.
+ *
+ * The global MSR is per socket, it can only be written from a cpu of
+ * @snap->nodeid. Called elsewhere, or without global registers, boxes are
+ * frozen one at a time instead. MSR boxes can not be reached from another
+ * socket in this context, their counts are 0 then. Call it with preemption
+ * disabled.
+ */
+void uncore_snapshot_read(struct uncore_snapshot *snap)
+{
+	struct uncore_pmu *pmu = &uncore_pmu;
+	bool local, global;
+	int i;
+
+	if (!snap->nr_boxes)
+		return;
+
+	local = numa_node_id() == snap->nodeid;
+	global = pmu->global_ctl && local;
+
+	if (global) {
+		wrmsrl(pmu->global_ctl, pmu->global_freeze);
+	} else {
+		for (i = 0; i < snap->nr_boxes; i++) {
+			if (local || !snap->boxes[i]->msr)
+				uncore_disable_box(snap->boxes[i]);
+		}
+	}
+
+	for (i = 0; i < snap->nr_boxes; i++) {
+		if (local || !snap->boxes[i]->msr)
+			uncore_box_read_events(snap->boxes[i], snap->values[i]);
+		else
+			memset(snap->values[i], 0, sizeof(snap->values[i]));
+	}
+
+	if (global) {
+		wrmsrl(pmu->global_ctl, pmu->global_unfreeze);
+	} else {
+		for (i = 0; i < snap->nr_boxes; i++) {
+			if (local || !snap->boxes[i]->msr)
+				uncore_enable_box(snap->boxes[i]);
+		}
+	}
+}
+
+/**
+ * uncore_snapshot_values
+ * @snap:	the snapshot in question
+ * @box:	the box to look for
+ * Return:	%NULL if @box is not in @snap
+ *
+ * Counts of @box in the last uncore_snapshot_read, indexed by counter.
+ */
+u64 *uncore_snapshot_values(struct uncore_snapshot *snap, struct uncore_box *box)
+{
+	int i;
+
+	for (i = 0; i < snap->nr_boxes; i++) {
+		if (snap->boxes[i] == box)
+			return snap->values[i];
+	}
+
+	return NULL;
+}
+
 static void __uncore_print_global_pmu(void *info)
 {
 	unsigned int config;
@@ -352,12 +808,17 @@ static void uncore_print_pci_boxes(void)
 	pr_info("\033[34m------------------------ PCI Type Boxes ----------------------\033[0m");
 	for (i = 0; uncore_pci_type[i]; i++) {
 		type = uncore_pci_type[i];
-		pr_info("PCI Type: %s Boxes: %d",
+		pr_info("PCI Type: %s Boxes per Node: %d",
 			type->name,
 			list_empty(&type->box_list)? 0: type->num_boxes);
 
 		list_for_each_entry(box, &type->box_list, next) {
-			pr_info("......Box%d, in Node%d, %x:%x:%x, %d:%d:%d, Kref = %d",
+			if (!box->pdev) {
+				pr_info("......Box%d, in Node%d, simulated",
+					box->idx, box->nodeid);
+				continue;
+			}
+			pr_info("......Box%d, in Node%d, %x:%x:%x, %d:%d:%d, Kref = %d, %s",
 			box->idx,
 			box->nodeid,
 			box->pdev->bus->number,
@@ -366,7 +827,8 @@ static void uncore_print_pci_boxes(void)
 			box->pdev->bus->number,
 			(box->pdev->devfn >> 3) & 0x1f,
 			(box->pdev->devfn) & 0x7,
-			box->pdev->dev.kobj.kref.refcount.counter);
+			box->pdev->dev.kobj.kref.refcount.counter,
+			box->io_addr ? "ECAM" : "CFG");
 		}
 		pr_info("\n");
 	}
@@ -380,13 +842,15 @@ static void uncore_print_pci_boxes(void)
  */
 static void uncore_print_pci_mapping(void)
 {
-	int bus;
+	int seg, bus;
 
 	pr_info("\033[34m------------------------ PCI Bus No. Mapping ----------------------\033[0m");
-	for (bus = 0; bus < 256; bus++) {
-		if (uncore_pcibus_to_nodeid[bus] != -1) {
-			pr_info("......BUS %d (0x%x) <---> NODE %d",
-				bus, bus, uncore_pcibus_to_nodeid[bus]);
+	for (seg = 0; seg < UNCORE_MAX_PCI_SEGMENT; seg++) {
+		for (bus = 0; bus < 256; bus++) {
+			if (uncore_pci_bus_node[seg][bus] != -1) {
+				pr_info("......BUS %04x:%02x <---> NODE %d",
+					seg, bus, uncore_pci_bus_node[seg][bus]);
+			}
 		}
 	}
 }
@@ -437,6 +901,51 @@ static int uncore_types_init(struct uncore_box_type **types)
 	return 0;
 }
 
+/**
+ * uncore_pci_ioremap
+ * @pdev:	the pci device to map
+ * Return:	%NULL on failure
+ *
+ * Map the 4K config space of @pdev through MMCONFIG. The ECAM window is
+ * found in the ACPI MCFG table, whose base address is the one of bus 0 of
+ * its segment. Accesses through the mapping are plain MMIO, without the
+ * pci_lock and the indirection of pci_ops, which is what we want on the
+ * polling hot path. Config space is side-effect free to read, so it is
+ * fine to mix with pci_read_config_* of the same device.
+ */
+static void __iomem *uncore_pci_ioremap(struct pci_dev *pdev)
+{
+	struct acpi_table_header *header;
+	struct acpi_mcfg_allocation *cfg;
+	unsigned int bus = pdev->bus->number;
+	int seg = pci_domain_nr(pdev->bus);
+	u64 addr = 0;
+	int i, n;
+
+	if (ACPI_FAILURE(acpi_get_table(ACPI_SIG_MCFG, 0, &header)))
+		return NULL;
+
+	n = (header->length - sizeof(struct acpi_table_mcfg)) / sizeof(*cfg);
+	cfg = (struct acpi_mcfg_allocation *)((struct acpi_table_mcfg *)header + 1);
+	for (i = 0; i < n; i++, cfg++) {
+		if (cfg->pci_segment == seg &&
+		    bus >= cfg->start_bus_number &&
+		    bus <= cfg->end_bus_number) {
+			addr = cfg->address + ((u64)bus << 20) + (pdev->devfn << 12);
+			break;
+		}
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	acpi_put_table(header);
+#endif
+
+	if (!addr)
+		return NULL;
+
+	return ioremap_nocache(addr, PAGE_SIZE);
+}
+
 /**
  * uncore_pci_new_box
  * @pdev:	the pci device of this box
@@ -444,39 +953,51 @@ static int uncore_types_init(struct uncore_box_type **types)
  * Return:	Non-zero on failure
  *
  * Malloc a new box of PCI type, initilize all the fields. And then insert it
- * into the tail of box_list of its uncore_box_type.
+ * into the tail of box_list of its uncore_box_type. The box owns the reference
+ * to @pdev taken by the caller, which is dropped if no box is added.
  */
 static int __must_check uncore_pci_new_box(struct pci_dev *pdev,
 					   const struct pci_device_id *id)
 {
 	struct uncore_box_type *type;
-	struct uncore_box *box, *last;
+	struct uncore_box *box;
+	int nodeid, ret;
 
 	type = uncore_pci_type[UNCORE_PCI_DEV_TYPE(id->driver_data)];
-	if (!type)
+	if (!type) {
+		pci_dev_put(pdev);
 		return -EFAULT;
+	}
 
-	box = kzalloc(sizeof(struct uncore_box), GFP_KERNEL);
-	if (!box)
+	/* Not in the table, nobody could find it */
+	nodeid = uncore_pcibus_to_nodeid(pdev->bus);
+	if (nodeid < 0 || nodeid >= UNCORE_MAX_SOCKET) {
+		pr_err("Skip %s box on unknown node, bus %04x:%02x",
+			type->name, pci_domain_nr(pdev->bus), pdev->bus->number);
+		pci_dev_put(pdev);
+		return 0;
+	}
+
+	box = uncore_alloc_box(sizeof(struct uncore_box), nodeid);
+	if (!box) {
+		pci_dev_put(pdev);
 		return -ENOMEM;
-	
-	if (list_empty(&type->box_list)) {
-		box->idx = 0;
-		type->num_boxes = 1;
-	} else {
-		last = list_last_entry(&type->box_list, struct uncore_box, next);
-		box->idx = last->idx + 1;
-		type->num_boxes++;
 	}
 	
-	uncore_box_init_hrtimer(box, uncore_box_hrtimer_def);
-	box->hrtimer_duration = UNCORE_PMU_HRTIMER_INTERVAL;
-	box->nodeid = uncore_pcibus_to_nodeid[pdev->bus->number];
-	box->box_type = type;
 	box->pdev = pdev;
-	list_add_tail(&box->next, &type->box_list);
+	if (uncore_ecam)
+		box->io_addr = uncore_pci_ioremap(pdev);
+
+	/* The same device of each node has the same idx */
+	ret = uncore_add_box(box, type, UNCORE_PCI_DEV_IDX(id->driver_data), nodeid);
+	if (ret) {
+		if (box->io_addr)
+			iounmap(box->io_addr);
+		pci_dev_put(pdev);
+		kfree(box);
+	}
 	
-	return 0;
+	return ret;
 }
 
 /* Free all PCI type boxes */
@@ -492,9 +1013,11 @@ static void uncore_pci_exit(void)
 		head = &type->box_list;
 		while (!list_empty(head)) {
 			box = list_first_entry(head, struct uncore_box, next);
-			list_del(&box->next);
+			uncore_del_box(box);
 			/* Since we have get_device manually */
 			pci_dev_put(box->pdev);
+			if (box->io_addr)
+				iounmap(box->io_addr);
 			kfree(box);
 		}
 	}
@@ -507,6 +1030,10 @@ static int __must_check uncore_pci_init(void)
 	struct pci_dev *pdev;
 	int ret;
 
+	/* Simulated boxes have no pci device, they are added by sim */
+	if (uncore_simulate)
+		return sim_pci_init();
+
 	ret = -ENXIO;
 	switch (boot_cpu_data.x86_model) {
 		case 45: /* Sandy Bridge-EP*/
@@ -547,8 +1074,11 @@ static int __must_check uncore_pci_init(void)
 			get_device(&pdev->dev);
 
 			ret = uncore_pci_new_box(pdev, ids);
-			if (ret)
+			if (ret) {
+				/* The reference pci_get_device holds for us */
+				pci_dev_put(pdev);
 				goto error;
+			}
 		}
 	}
 
@@ -563,31 +1093,31 @@ error:
  * uncore_msr_new_box
  * @type:	the MSR box_type
  * @idx:	the idx of the new box
+ * @nodeid:	the socket of the new box
  * Return:	Non-zero on failure
  *
  * Malloc a new box of MSR type, and then insert it into the tail
  * of box_list of its uncore_box_type.
  */
 static int __must_check uncore_msr_new_box(struct uncore_box_type *type,
-					   unsigned int idx)
+					   unsigned int idx, unsigned int nodeid)
 {
 	struct uncore_box *box;
+	int ret;
 
 	if (!type)
 		return -EINVAL;
 
-	box = kzalloc(sizeof(struct uncore_box), GFP_KERNEL);
+	box = uncore_alloc_box(sizeof(struct uncore_box), nodeid);
 	if (!box)
 		return -ENOMEM;
 
-	uncore_box_init_hrtimer(box, uncore_box_hrtimer_def);
-	box->hrtimer_duration = UNCORE_PMU_HRTIMER_INTERVAL;
-	box->idx = idx;
-	box->nodeid = 0;	/* XXX */
-	box->box_type = type;
-	list_add_tail(&box->next, &type->box_list);
+	box->msr = true;
+	ret = uncore_add_box(box, type, idx, nodeid);
+	if (ret)
+		kfree(box);
 
-	return 0;
+	return ret;
 }
 
 /* Free MSR type boxes */
@@ -603,7 +1133,7 @@ static void uncore_cpu_exit(void)
 		head = &type->box_list;
 		while (!list_empty(head)) {
 			box = list_first_entry(head, struct uncore_box, next);
-			list_del(&box->next);
+			uncore_del_box(box);
 			kfree(box);
 		}
 	}
@@ -613,9 +1143,13 @@ static void uncore_cpu_exit(void)
 static int __must_check uncore_cpu_init(void)
 {
 	struct uncore_box_type *type;
-	unsigned int idx;
+	unsigned int idx, node;
 	int n, ret;
 
+	/* No MSR boxes are simulated */
+	if (uncore_simulate)
+		return sim_cpu_init();
+
 	ret = -ENXIO;
 	switch (boot_cpu_data.x86_model) {
 		case 45: /* Sandy Bridge-EP*/
@@ -634,12 +1168,17 @@ static int __must_check uncore_cpu_init(void)
 	if (ret)
 		return ret;
 	
-	for (n = 0; uncore_msr_type[n]; n++) {
-		type = uncore_msr_type[n];
-		for (idx = 0; idx < type->num_boxes; idx++) {
-			ret = uncore_msr_new_box(type, idx);
-			if (ret)
-				goto error;
+	/* MSR boxes are per socket, sockets without online cpus are unreachable */
+	for_each_online_node(node) {
+		if (node >= UNCORE_MAX_SOCKET || first_online_cpu_of_node(node) < 0)
+			continue;
+		for (n = 0; uncore_msr_type[n]; n++) {
+			type = uncore_msr_type[n];
+			for (idx = 0; idx < type->num_boxes; idx++) {
+				ret = uncore_msr_new_box(type, idx, node);
+				if (ret)
+					goto error;
+			}
 		}
 	}
 
@@ -665,14 +1204,32 @@ static int uncore_init(void)
 	if (ret)
 		goto cpuerr;
 
+	ret = uncore_catalog_init();
+	if (ret)
+		goto cpuerr;
+
 	ret = uncore_imc_init();
 	if (ret)
-		goto out;
+		goto catalog;
 
 	ret = uncore_proc_create();
 	if (ret)
 		goto out;
 
+	if (uncore_simulate) {
+		ret = sim_proc_create();
+		if (ret)
+			goto proc;
+	}
+
+	ret = uncore_ring_init();
+	if (ret)
+		goto sim;
+
+	ret = uncore_calib_init();
+	if (ret)
+		goto ring;
+
 	/*
 	 * Pay attention to these messages
 	 * Check if everything goes as expected
@@ -692,8 +1249,17 @@ static int uncore_init(void)
 
 	return 0;
 
+ring:
+	uncore_ring_exit();
+sim:
+	if (uncore_simulate)
+		sim_proc_remove();
+proc:
+	uncore_proc_remove();
 out:
 	uncore_imc_exit();
+catalog:
+	uncore_catalog_exit();
 cpuerr:
 	uncore_cpu_exit();
 pcierr:
@@ -703,14 +1269,24 @@ pcierr:
 
 static void uncore_exit(void)
 {
+	/*
+	 * A running calibration puts throttle state back when it ends,
+	 * removing its proc file waits for that.
+	 */
+	uncore_calib_exit();
+
 	/*
 	 * Game over, back to DRAM
 	 */
 	finish_emulate_nvm();
 	
 	uncore_clear_global_pmu(&uncore_pmu);
+	uncore_ring_exit();
+	if (uncore_simulate)
+		sim_proc_remove();
 	uncore_proc_remove();
 	uncore_imc_exit();
+	uncore_catalog_exit();
 	uncore_cpu_exit();
 	uncore_pci_exit();
 	
@@ -24,15 +24,28 @@
 #define pr_fmt(fmt) "UNCORE_PMU: " fmt
 #endif
 
+#include <linux/io.h>
 #include <linux/pci.h>
 #include <linux/types.h>
+#include <linux/string.h>
+#include <linux/cache.h>
 #include <linux/hrtimer.h>
 #include <linux/compiler.h>
+#include <linux/atomic.h>
 
 #define UNCORE_PMU_HRTIMER_INTERVAL     (60 * NSEC_PER_SEC)
 
 #define UNCORE_MAX_SOCKET		8
 
+/* PCI segments (domains) we map, big hosts put sockets in their own one */
+#define UNCORE_MAX_PCI_SEGMENT		UNCORE_MAX_SOCKET
+
+/* Boxes of a type within a node, the most is Cbox of 18-core HSWEP */
+#define UNCORE_MAX_BOXES		18
+
+/* Events a box could count at the same time, the most is HA */
+#define UNCORE_BOX_MAX_EVENTS		5
+
 /* PCI Driver Data <--> Box Type and IDX */
 #define UNCORE_PCI_DEV_DATA(type, idx)	(((type) << 8) | (idx))
 #define UNCORE_PCI_DEV_TYPE(data)	(((data) >> 8) & 0xFF)
@@ -58,46 +71,82 @@ enum {
 
 struct uncore_box_type;
 
+/* Name of an event in perfmon JSON, e.g. UNC_H_REQUESTS.READS_REMOTE */
+#define UNCORE_EVENT_NAME_LEN		64
+
+/* Counter control of an event, the layout is the same on SNB/IVB/HSX-EP */
+#define UNCORE_EVENT_ENABLE(code, umask)	\
+	((1 << 22) | (1 << 20) | (((umask) & 0xFF) << 8) | ((code) & 0xFF))
+
 /**
  * struct uncore_event
  * @enable:	Bit mask to enable this event
  * @disable:	Bis mask to disable this event
+ * @counters:	Bit mask of counters able to count this event, 0 means all
+ * @filter:	Value of box filter register, 0 if no filter needed
+ * @max_inc:	Max increment per cycle, 0 if unknown
+ * @unit:	Unit in perfmon JSON, e.g. HA, iMC, CBO
+ * @name:	Name in perfmon JSON, used to find the event in catalog
  * @desc:	Description about this event
- * @next:	Pointer to next event
+ * @dynamic:	Loaded at runtime, kfree'd on exit
+ * @next:	Pointer to next event in catalog
  */
 struct uncore_event {
 	u64			enable;
 	u64			disable;
+	unsigned int		counters;
+	u64			filter;
+	unsigned int		max_inc;
+	const char		*unit;
+	const char		*name;
 	const char		*desc;
+	bool			dynamic;
 	struct list_head	next;
 };
 
 /**
  * struct uncore_box
- * @idx:		Index of this box
+ * @idx:		Index of this box within its node
  * @nodeid:		NUMA node id of this box
+ * @pdev:		PCI device of this box (For PCI type box, %NULL if simulated)
+ * @next:		List of the same type boxes
+ * @msr:		MSR type box, only reachable from a cpu of @nodeid
+ * @box_type:		Pointer to the type of this box
+ * @io_addr:		ECAM mapping of config space of @pdev, %NULL if absent
  * @hrtimer_duration:	Duration of hrtimer
+ * @num_events:		Number of events in the group
+ * @events:		Event group, events[i] is counted by counter i
+ * @last_values:	Counter values at last uncore_box_read_events
  * @hrtimer:		hrtimer to poll the box
- * @event:		Currently counting or sampling event
- * @box_type:		Pointer to the type of this box
- * @pdev:		PCI device of this box (For PCI type box)
- * @next:		List of the same type boxes
  *
  * Describe a single uncore pmu box instance. All boxes of the same type
- * are linked together. Since all boxes of all nodes all mixed together,
- * hence node_id is needed to distinguish two boxes with the same idx but
- * lay in different nodes. Note that, MSR type boxes are bond to specific
- * cpu, manipulations of this type box should be called on wanted cpu.
+ * are linked together, and also indexed by [nodeid][idx] in boxes table of
+ * their type. Note that, MSR type boxes are bond to cpus of their socket.
+ * Box methods below run them on a cpu of @nodeid, through IPI if the caller
+ * is on another socket, so MSR boxes of all sockets can be used alike.
+ *
+ * Events of a box form a group. Counters of a group are free-running, they
+ * are read back to back and never cleared, so all counts of a group belong
+ * to nearly the same time window.
+ *
+ * Boxes are allocated on their own node. Fields used by every poll start at
+ * a new cacheline, away from the ones only used at init and exit.
  */
 struct uncore_box {
 	unsigned int		idx;
 	unsigned int		nodeid;
-	u64			hrtimer_duration;
-	struct hrtimer		hrtimer;
-	struct uncore_event	*event;
-	struct uncore_box_type	*box_type;
 	struct pci_dev		*pdev;
 	struct list_head	next;
+	bool			msr;
+
+	/* Hot, touched by every poll */
+	struct uncore_box_type	*box_type ____cacheline_aligned_in_smp;
+	void __iomem		*io_addr;
+	u64			hrtimer_duration;
+	unsigned int		num_events;
+	struct uncore_event	*events[UNCORE_BOX_MAX_EVENTS];
+	u64			last_values[UNCORE_BOX_MAX_EVENTS];
+	struct hrtimer		hrtimer;
 };
 
 /**
@@ -115,6 +164,8 @@ struct uncore_box {
  *
  * Describe methods for manipulating a uncore PMU box. The methods are
  * microarchitecture specific. Some of them could be %NULL, e.g. read_filter.
+ * Event and counter methods take the index of counter within the box, which
+ * must be less than num_counters of its box_type.
  */
 struct uncore_box_ops {
 	void (*show_box)(struct uncore_box *box);
@@ -122,10 +173,10 @@ struct uncore_box_ops {
 	void (*clear_box)(struct uncore_box *box);
 	void (*enable_box)(struct uncore_box *box);
 	void (*disable_box)(struct uncore_box *box);
-	void (*enable_event)(struct uncore_box *box, struct uncore_event *event);
-	void (*disable_event)(struct uncore_box *box, struct uncore_event *event);
-	void (*write_counter)(struct uncore_box *box, u64 value);
-	void (*read_counter)(struct uncore_box *box, u64 *value);
+	void (*enable_event)(struct uncore_box *box, unsigned int idx, struct uncore_event *event);
+	void (*disable_event)(struct uncore_box *box, unsigned int idx, struct uncore_event *event);
+	void (*write_counter)(struct uncore_box *box, unsigned int idx, u64 value);
+	void (*read_counter)(struct uncore_box *box, unsigned int idx, u64 *value);
 	void (*write_filter)(struct uncore_box *box, u64 value);
 	void (*read_filter)(struct uncore_box *box, u64 *value);
 };
@@ -134,7 +185,7 @@ struct uncore_box_ops {
  * struct uncore_box_type
  * @name:		Name of this type box
  * @num_counters:	Counters this type box has
- * @num_boxes:		Boxes this type box has
+ * @num_boxes:		Boxes this type box has within a node
  * @perf_ctr_bits:	Bit width of PMC
  * @perf_ctr:		PMC address
  * @perf_ctl:		EventSel address
@@ -148,6 +199,7 @@ struct uncore_box_ops {
  * @box_filter1:	Box-level Filter1 address
  * @msr_offset:		MSR address offset of next box
  * @box_list:		List of all avaliable boxes of this type
+ * @boxes:		Boxes of this type, indexed by [nodeid][idx]
  * @ops:		Box manipulation functions
  *
  * This struct describes a specific type of box. All box instances are linked
@@ -171,6 +223,7 @@ struct uncore_box_type {
 	unsigned int	msr_offset;
 	
 	struct list_head box_list;
+	struct uncore_box *boxes[UNCORE_MAX_SOCKET][UNCORE_MAX_BOXES];
 	const struct uncore_box_ops *ops;
 };
 
@@ -183,6 +236,8 @@ struct uncore_box_type {
  * @global_ctl:		MSR address of global control register (per socket)
  * @global_status:	MSR address of global status register (per socket)
  * @global_config:	MSR address of global config register (per socket)
+ * @global_freeze:	Value written to global_ctl to freeze all boxes
+ * @global_unfreeze:	Value written to global_ctl to un-freeze all boxes
  *
  * This structure is the TOP description about UNCORE_PMU. The main reason to
  * have such a global description structure is sometimes we need to manipulate
@@ -198,13 +253,41 @@ struct uncore_pmu {
 	unsigned int		global_ctl;
 	unsigned int		global_status;
 	unsigned int		global_config;
+	u64			global_freeze;
+	u64			global_unfreeze;
+};
+
+/* Boxes a snapshot could hold, one socket has no more bound boxes */
+#define UNCORE_SNAPSHOT_MAX_BOXES	16
+
+/**
+ * struct uncore_snapshot
+ * @nodeid:		NUMA node this snapshot covers
+ * @nr_boxes:		Number of boxes in @boxes
+ * @boxes:		Boxes having an event group on @nodeid
+ * @values:		Counts since last read, @values[i] belongs to @boxes[i]
+ * @gen:		uncore_box_events_gen when @boxes were collected
+ *
+ * Counts of all bound boxes of a socket taken at the same instant. Set up
+ * by uncore_snapshot_init after event groups are added, then refreshed by
+ * uncore_snapshot_read every poll. Once uncore_snapshot_changed says event
+ * groups changed, set it up again.
+ */
+struct uncore_snapshot {
+	unsigned int		nodeid;
+	unsigned int		nr_boxes;
+	unsigned int		gen;
+	struct uncore_box	*boxes[UNCORE_SNAPSHOT_MAX_BOXES];
+	u64			values[UNCORE_SNAPSHOT_MAX_BOXES][UNCORE_BOX_MAX_EVENTS];
 };
 
+extern bool uncore_simulate;
+extern atomic_t uncore_box_events_gen;
 extern unsigned int uncore_socket_number;
 extern struct uncore_box_type **uncore_msr_type;
 extern struct uncore_box_type **uncore_pci_type;
 extern struct pci_driver *uncore_pci_driver;
-extern unsigned int uncore_pcibus_to_nodeid[256];
+extern int uncore_pci_bus_node[UNCORE_MAX_PCI_SEGMENT][256];
 extern struct uncore_pmu uncore_pmu;
 
 /*
@@ -216,10 +299,26 @@ static inline u64 uncore_box_ctr_mask(struct uncore_box *box)
 	return (1ULL << box->box_type->perf_ctr_bits) - 1;
 }
 
+/* Counts from @prev to @now, a counter wraps at most once in between */
+static inline u64 uncore_box_ctr_delta(struct uncore_box *box, u64 prev, u64 now)
+{
+	return (now - prev) & uncore_box_ctr_mask(box);
+}
+
 /*
  * PCI Type Box
  */
 
+/* NUMA node of the socket which @bus belongs to, -1 if unknown */
+static inline int uncore_pcibus_to_nodeid(struct pci_bus *bus)
+{
+	int seg = pci_domain_nr(bus);
+
+	if (seg < 0 || seg >= UNCORE_MAX_PCI_SEGMENT)
+		return -1;
+	return uncore_pci_bus_node[seg][bus->number];
+}
+
 static inline unsigned int uncore_pci_box_status(struct uncore_box *box)
 {
 	return box->box_type->box_status;
@@ -235,14 +334,32 @@ static inline unsigned int uncore_pci_box_filter(struct uncore_box *box)
 	return box->box_type->box_filter0;
 }
 
-static inline unsigned int uncore_pci_perf_ctl(struct uncore_box *box)
+/*
+ * Read config space of a PCI type box. Through ECAM if it is mapped, which
+ * is lock-free, otherwise through pci_ops, which takes pci_lock.
+ */
+static inline void uncore_pci_read_dword(struct uncore_box *box,
+					 unsigned int offset, u32 *value)
+{
+	void __iomem *io_addr = READ_ONCE(box->io_addr);
+
+	if (io_addr)
+		*value = readl(io_addr + offset);
+	else
+		pci_read_config_dword(box->pdev, offset, value);
+}
+
+/* Control registers are 32-bit, counter registers are 64-bit */
+static inline unsigned int uncore_pci_perf_ctl(struct uncore_box *box,
+					       unsigned int idx)
 {
-	return box->box_type->perf_ctl;
+	return box->box_type->perf_ctl + 4 * idx;
 }
 
-static inline unsigned int uncore_pci_perf_ctr(struct uncore_box *box)
+static inline unsigned int uncore_pci_perf_ctr(struct uncore_box *box,
+					       unsigned int idx)
 {
-	return box->box_type->perf_ctr;
+	return box->box_type->perf_ctr + 8 * idx;
 }
 
 /*
@@ -269,25 +386,71 @@ static inline unsigned int uncore_msr_box_filter(struct uncore_box *box)
 	return box->box_type->box_filter0 + uncore_msr_box_offset(box);
 }
 
-static inline unsigned int uncore_msr_perf_ctl(struct uncore_box *box)
+static inline unsigned int uncore_msr_perf_ctl(struct uncore_box *box,
+					       unsigned int idx)
 {
-	return box->box_type->perf_ctl + uncore_msr_box_offset(box);
+	return box->box_type->perf_ctl + uncore_msr_box_offset(box) + idx;
 }
 
-static inline unsigned int uncore_msr_perf_ctr(struct uncore_box *box)
+static inline unsigned int uncore_msr_perf_ctr(struct uncore_box *box,
+					       unsigned int idx)
 {
-	return box->box_type->perf_ctr + uncore_msr_box_offset(box);
+	return box->box_type->perf_ctr + uncore_msr_box_offset(box) + idx;
 }
 
 /******************************************************************************
  * Generic Uncore PMU Box's APIs
  *****************************************************************************/
 
+/* Box methods, for those shipped to the socket of an MSR box */
+enum uncore_box_op {
+	UNCORE_BOX_SHOW,
+	UNCORE_BOX_INIT,
+	UNCORE_BOX_CLEAR,
+	UNCORE_BOX_ENABLE,
+	UNCORE_BOX_DISABLE,
+	UNCORE_BOX_ENABLE_EVENT,
+	UNCORE_BOX_DISABLE_EVENT,
+	UNCORE_BOX_WRITE_COUNTER,
+	UNCORE_BOX_READ_COUNTER,
+	UNCORE_BOX_WRITE_FILTER,
+	UNCORE_BOX_READ_FILTER
+};
+
+/**
+ * struct uncore_box_call
+ * @box:	the box to manipulate
+ * @op:		the method to run
+ * @idx:	counter of event and counter methods
+ * @event:	event of event methods
+ * @value:	value of write methods
+ * @valuep:	place to hold value of read methods
+ */
+struct uncore_box_call {
+	struct uncore_box	*box;
+	enum uncore_box_op	op;
+	unsigned int		idx;
+	struct uncore_event	*event;
+	u64			value;
+	u64			*valuep;
+};
+
 void uncore_clear_global_pmu(struct uncore_pmu *pmu);
 void uncore_print_global_pmu(struct uncore_pmu *pmu);
 
+int uncore_snapshot_init(struct uncore_snapshot *snap, unsigned int nodeid);
+void uncore_snapshot_read(struct uncore_snapshot *snap);
+u64 *uncore_snapshot_values(struct uncore_snapshot *snap, struct uncore_box *box);
+
+/* Event groups of some box changed since @snap was set up */
+static inline bool uncore_snapshot_changed(const struct uncore_snapshot *snap)
+{
+	return snap->gen != (unsigned int)atomic_read(&uncore_box_events_gen);
+}
+
 int first_online_cpu_of_node(unsigned int node);
 int uncore_call_function_on_node(unsigned int node, void (*func)(void *info), void *info, int wait);
+void uncore_box_call_on_node(struct uncore_box_call *call);
 
 void uncore_box_start_hrtimer(struct uncore_box *box);
 void uncore_box_cancel_hrtimer(struct uncore_box *box);
@@ -295,24 +458,17 @@ void uncore_box_change_hrtimer(struct uncore_box *box, enum hrtimer_restart (*fu
 void uncore_box_change_duration(struct uncore_box *box, u64 new);
 
 
+void *uncore_alloc_box(size_t size, unsigned int nodeid);
+int __must_check uncore_add_box(struct uncore_box *box, struct uncore_box_type *type, unsigned int idx, unsigned int nodeid);
+void uncore_del_box(struct uncore_box *box);
 struct uncore_box *uncore_get_box(struct uncore_box_type *type, unsigned int idx, unsigned int nodeid);
 struct uncore_box *uncore_get_first_box(struct uncore_box_type *type, unsigned int nodeid);
 
-/**
- * uncore_box_bind_event
- * @box:	the box to bind
- * @event:	the event to bind
- *
- * Bind a event to a box. Actually, it is uselee... This function just build a
- * link between box and event. When user invoke show_box, it can print some
- * nice information about current sampling or counting event.
- */
-static inline void uncore_box_bind_event(struct uncore_box *box,
-					 struct uncore_event *event)
-{
-	if (box && event)
-		box->event = event;
-}
+int __must_check uncore_box_add_event(struct uncore_box *box, struct uncore_event *event);
+void uncore_box_del_events(struct uncore_box *box);
+void uncore_box_read_events(struct uncore_box *box, u64 *values);
+int uncore_box_replace_event(struct uncore_box *box, unsigned int idx, struct uncore_event *event);
+int uncore_box_bench_read(struct uncore_box *box, unsigned int loops, u64 *ecam_ns, u64 *cfg_ns);
 
 /**
  * uncore_show_box
@@ -322,7 +478,11 @@ static inline void uncore_box_bind_event(struct uncore_box *box,
  */
 static inline void uncore_show_box(struct uncore_box *box)
 {
-	if (box->box_type->ops->show_box)
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_SHOW };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->show_box)
 		box->box_type->ops->show_box(box);
 }
 
@@ -331,13 +491,19 @@ static inline void uncore_show_box(struct uncore_box *box)
  * @box:	the box to init
  *
  * Initialize a uncore box for a new event.
- * This method will clear the control and the counter registers.
- * Always call this if you want to begin a new event to count or sample.
+ * This method will clear the control and the counter registers, and empty
+ * the event group. Always call this before adding events to count or sample.
  */
 static inline void uncore_init_box(struct uncore_box *box)
 {
-	if (box->box_type->ops->init_box)
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_INIT };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->init_box)
 		box->box_type->ops->init_box(box);
+	memset(box->events, 0, sizeof(box->events));
+	box->num_events = 0;
 }
 
 /**
@@ -350,8 +516,14 @@ static inline void uncore_init_box(struct uncore_box *box)
  */
 static inline void uncore_clear_box(struct uncore_box *box)
 {
-	if (box->box_type->ops->clear_box)
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_CLEAR };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->clear_box)
 		box->box_type->ops->clear_box(box);
+	memset(box->events, 0, sizeof(box->events));
+	box->num_events = 0;
 }
 
 /**
@@ -364,7 +536,11 @@ static inline void uncore_clear_box(struct uncore_box *box)
  */
 static inline void uncore_enable_box(struct uncore_box *box)
 {
-	if (box->box_type->ops->enable_box)
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_ENABLE };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->enable_box)
 		box->box_type->ops->enable_box(box);
 }
 
@@ -378,66 +554,96 @@ static inline void uncore_enable_box(struct uncore_box *box)
  */
 static inline void uncore_disable_box(struct uncore_box *box)
 {
-	if (box->box_type->ops->disable_box)
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_DISABLE };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->disable_box)
 		box->box_type->ops->disable_box(box);
 }
 
 /**
  * uncore_enable_event
  * @box:	the box to enable
+ * @idx:	the counter to use
  * @event:	the event to count or sample
  *
- * Assign a specific event to box.
+ * Assign a specific event to counter @idx of box.
  * This method will *NOT* start counting, call uncore_enable_box to start.
  */
-static inline void uncore_enable_event(struct uncore_box *box,
+static inline void uncore_enable_event(struct uncore_box *box, unsigned int idx,
 				       struct uncore_event *event)
 {
-	if (box->box_type->ops->enable_event)
-		box->box_type->ops->enable_event(box, event);
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_ENABLE_EVENT,
+					 .idx = idx, .event = event };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->enable_event)
+		box->box_type->ops->enable_event(box, idx, event);
 }
 
 /**
  * uncore_disable_event
  * @box:	the box to disable
+ * @idx:	the counter in question
  * @event:	the event to disable
  *
- * Remove a specific event from box.
+ * Remove a specific event from counter @idx of box.
  * This method will *NOT* disable counting, call uncore_disable_box to stop.
  */
-static inline void uncore_disable_event(struct uncore_box *box,
+static inline void uncore_disable_event(struct uncore_box *box, unsigned int idx,
 					struct uncore_event *event)
 {
-	if (box->box_type->ops->disable_event)
-		box->box_type->ops->disable_event(box, event);
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_DISABLE_EVENT,
+					 .idx = idx, .event = event };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->disable_event)
+		box->box_type->ops->disable_event(box, idx, event);
 }
 
 /**
  * uncore_write_counter
  * @box:	the box to write
+ * @idx:	the counter to write
  * @value:	the value to write
  *
- * Write to the counter of this box.
+ * Write to the counter @idx of this box.
  * Most useful when sampling events.
  */
-static inline void uncore_write_counter(struct uncore_box *box, u64 value)
+static inline void uncore_write_counter(struct uncore_box *box, unsigned int idx,
+					u64 value)
 {
-	if (box->box_type->ops->write_counter)
-		box->box_type->ops->write_counter(box, value);
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_WRITE_COUNTER,
+					 .idx = idx, .value = value };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->write_counter)
+		box->box_type->ops->write_counter(box, idx, value);
 }
 
 /**
  * uncore_read_counter
  * @box:	the box to read
+ * @idx:	the counter to read
  * @value:	place to hold value
  *
- * Read the counter of this box.
+ * Read the counter @idx of this box.
  * Lightweight show method, most useful when debugging.
  */
-static inline void uncore_read_counter(struct uncore_box *box, u64 *value)
+static inline void uncore_read_counter(struct uncore_box *box, unsigned int idx,
+				       u64 *value)
 {
-	if (box->box_type->ops->read_counter)
-		box->box_type->ops->read_counter(box, value);
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_READ_COUNTER,
+					 .idx = idx, .valuep = value };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->read_counter)
+		box->box_type->ops->read_counter(box, idx, value);
 }
 
 /**
@@ -450,7 +656,12 @@ static inline void uncore_read_counter(struct uncore_box *box, u64 *value)
  */
 static inline void uncore_write_filter(struct uncore_box *box, u64 value)
 {
-	if (box->box_type->ops->write_filter)
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_WRITE_FILTER,
+					 .value = value };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->write_filter)
 		box->box_type->ops->write_filter(box, value);
 }
 
@@ -463,7 +674,12 @@ static inline void uncore_write_filter(struct uncore_box *box, u64 value)
  */
 static inline void uncore_read_filter(struct uncore_box *box, u64 *value)
 {
-	if (box->box_type->ops->read_filter)
+	struct uncore_box_call call = { .box = box, .op = UNCORE_BOX_READ_FILTER,
+					 .valuep = value };
+
+	if (box->msr)
+		uncore_box_call_on_node(&call);
+	else if (box->box_type->ops->read_filter)
 		box->box_type->ops->read_filter(box, value);
 }
 
@@ -474,39 +690,102 @@ static inline void uncore_read_filter(struct uncore_box *box, u64 *value)
 int uncore_proc_create(void);
 void uncore_proc_remove(void);
 
+/******************************************************************************
+ * Event Catalog Part
+ *****************************************************************************/
+
+int uncore_catalog_init(void);
+void uncore_catalog_exit(void);
+int uncore_catalog_add(struct uncore_event *event);
+struct uncore_event *uncore_catalog_find(const char *name);
+
+int uncore_ring_init(void);
+void uncore_ring_exit(void);
+void uncore_ring_set_layout(unsigned int nodeid, const char * const *names, unsigned int nr);
+void uncore_ring_write(unsigned int nodeid, u64 period_ns, const u64 *values, unsigned int nr);
+
 /******************************************************************************
  * IMC Part
  *****************************************************************************/
 
+/* THRT_PWR is 12 bits wide, the reset value throttles nothing */
+#define UNCORE_IMC_THRT_PWR_MAX		0x0fff
+
+/* Every CAS moves a cacheline */
+#define UNCORE_IMC_CAS_BYTES		64
+
+/* [thrt_pwr_dimm_[0:2]], one per DIMM slot of a channel */
+#define UNCORE_IMC_DIMMS_PER_CHANNEL	3
+#define UNCORE_IMC_ALL_DIMMS		((1 << UNCORE_IMC_DIMMS_PER_CHANNEL) - 1)
+
+/* Wildcard of IMC or channel, see uncore_imc_set_thrt_pwr */
+#define UNCORE_IMC_ANY			(-1)
+
+/* driver_data of IMC pci_device_id: which IMC and channel the device is */
+#define UNCORE_IMC_DEV_DATA(mc, chn)	(((mc) << 8) | (chn))
+#define UNCORE_IMC_DEV_MC(data)		(((data) >> 8) & 0xFF)
+#define UNCORE_IMC_DEV_CHANNEL(data)	((data) & 0xFF)
+
 /**
  * struct uncore_imc_ops
  * @set_threshold:
+ * @set_thrt_pwr:
  * @enable_throttle:
  * @disable_throttle:
+ * @charge:
+ * @save_thrt_pwr:
+ * @restore_thrt_pwr:
  *
- * CPU specific methods to manipulate a single IMC.
+ * CPU specific methods to manipulate a single IMC. @set_thrt_pwr writes
+ * a raw THRT_PWR value to DIMM slots of the channel set in a bit mask,
+ * it must be safe in hardirq context. @charge is only there if throttling
+ * is done in software, see uncore_imc_charge. @save_thrt_pwr and
+ * @restore_thrt_pwr copy the whole throttle state of each DIMM slot, enable
+ * bit included, for calibration to put back what it found.
  */
+struct uncore_imc;
 struct uncore_imc_ops {
-	int	(*set_threshold)(struct pci_dev *pdev, unsigned int threshold);
-	int	(*enable_throttle)(struct pci_dev *pdev);
-	void	(*disable_throttle)(struct pci_dev *pdev);
+	int	(*set_threshold)(struct uncore_imc *imc, unsigned int threshold);
+	void	(*set_thrt_pwr)(struct uncore_imc *imc, unsigned int dimms,
+				unsigned int thrt);
+	int	(*enable_throttle)(struct uncore_imc *imc);
+	void	(*disable_throttle)(struct uncore_imc *imc);
+	u64	(*charge)(struct uncore_imc *imc, u64 bytes);
+	void	(*save_thrt_pwr)(struct uncore_imc *imc, u16 *regs);
+	void	(*restore_thrt_pwr)(struct uncore_imc *imc, const u16 *regs);
 };
 
 /**
  * struct uncore_imc
  * @nodeid:	Physcial node this imc on
+ * @mc:		Which IMC of the node this channel belongs to
+ * @channel:	Channel within @mc
  * @list:	Point to next imc device
- * @pdev:	the pci device instance
+ * @pdev:	the pci device instance (%NULL if simulated)
  * @ops:	Methods to manipulate IMC
+ * @box:	PMON box of the same channel, counts CAS for the controller
+ * @target:	Bandwidth the controller holds this channel at, 0 if none
+ * @thrt:	THRT_PWR written by the controller
+ * @mbps:	Bandwidth measured by the controller in the last period
+ * @saved_thrt:	Throttle state of each DIMM slot before calibration
  *
  * This structure describes the IMC device used in uncore. We have this
  * one mainly because we want to control the bandwith more convenient. 
+ * Each one is a single channel, throttled on its own.
  */
 struct uncore_imc {
 	unsigned int nodeid;
+	unsigned int mc;
+	unsigned int channel;
 	struct list_head next;
 	struct pci_dev *pdev;
 	const struct uncore_imc_ops *ops;
+
+	struct uncore_box *box;
+	unsigned int target;
+	unsigned int thrt;
+	u64 mbps;
+	u16 saved_thrt[UNCORE_IMC_DIMMS_PER_CHANNEL];
 };
 
 extern const struct pci_device_id *uncore_imc_device_ids;
@@ -525,11 +804,40 @@ int uncore_imc_set_threshold_all(unsigned int threshold);
 int uncore_imc_enable_throttle_all(void);
 void uncore_imc_disable_throttle_all(void);
 
+int uncore_imc_set_thrt_pwr(unsigned int nodeid, int mc, int channel,
+			    unsigned int dimms, unsigned int thrt);
+u64 uncore_imc_charge(unsigned int nodeid, u64 bytes);
+
+int uncore_imc_claim(unsigned int nodeid);
+void uncore_imc_release(void);
+int uncore_imc_set_calib_thrt(unsigned int thrt);
+unsigned int uncore_imc_read_cas(unsigned int nodeid, u64 *reads, u64 *writes);
+
+struct seq_file;
+int uncore_imc_set_target(unsigned int nodeid, int mc, int channel, unsigned int mbps);
+void uncore_imc_show_control(struct seq_file *m);
+
+/* Calibration of THRT_PWR, see uncore_imc_calib.c */
+int uncore_calib_init(void);
+void uncore_calib_exit(void);
+unsigned int uncore_calib_thrt(unsigned int nodeid, unsigned int threshold);
+
 /******************************************************************************
  * Micro-Architecture Specific Part
  *****************************************************************************/
 
 /* Haswell-EP	*/
+int hswep_catalog_init(void);
 int hswep_cpu_init(void);
 int hswep_pci_init(void);
 int hswep_imc_init(void);
+
+/* Simulated, see uncore_sim.c */
+int sim_cpu_init(void);
+int sim_pci_init(void);
+int sim_imc_init(void);
+
+/* Software throttling, see uncore_imc_sw.c */
+int sw_imc_init(void);
+int sim_proc_create(void);
+void sim_proc_remove(void);
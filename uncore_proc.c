@@ -25,61 +25,218 @@
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/mutex.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/nodemask.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 
-static int bw_ratio = 1;
+/*
+ * Throttling ratio of each node, 1/bw_ratio of full bandwidth, 0 if mixed.
+ * Not shown while bw_target of the node is set.
+ */
+static int bw_ratio[UNCORE_MAX_SOCKET] = { [0 ... UNCORE_MAX_SOCKET - 1] = 1 };
+
+/* MB/s the controller holds every channel of each node at, 0 if none */
+static unsigned int bw_target[UNCORE_MAX_SOCKET];
 static DEFINE_MUTEX(uncore_proc_mutex);
 
+/* Average ns per counter read, of the last 'b' */
+#define UNCORE_PROC_BENCH_LOOPS	10000
+static u64 bench_ecam_ns, bench_cfg_ns;
+static int bench_node = -1;
+
 static int pmu_proc_show(struct seq_file *file, void *v)
 {
-	seq_printf(file, "Bandwidth Throttling Ratio: 1/%d", bw_ratio);
+	int node;
+
+	seq_printf(file, "Bandwidth Throttling Ratio:");
+	for_each_online_node(node) {
+		if (node >= UNCORE_MAX_SOCKET)
+			continue;
+		if (bw_target[node])
+			seq_printf(file, " N%d %uMB/s/ch (controlled)",
+				node, bw_target[node]);
+		else if (bw_ratio[node])
+			seq_printf(file, " N%d 1/%d", node, bw_ratio[node]);
+		else
+			seq_printf(file, " N%d mixed", node);
+	}
+	uncore_imc_show_control(file);
+	if (bench_node >= 0)
+		seq_printf(file, "\nCounter Read (N%d): ECAM %llu ns, CFG %llu ns",
+			bench_node, bench_ecam_ns, bench_cfg_ns);
 	
 	return 0;
 }
 
+/* Time counter reads of the HA box of @node, through both paths */
+static int uncore_proc_bench(int node)
+{
+	struct uncore_box *box;
+	int ret;
+
+	box = uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], node);
+	if (!box)
+		return -ENODEV;
+
+	ret = uncore_box_bench_read(box, UNCORE_PROC_BENCH_LOOPS,
+				    &bench_ecam_ns, &bench_cfg_ns);
+	if (!ret)
+		bench_node = node;
+	return ret;
+}
+
+/* Throttle every node of @nodes to 1/@ratio bandwidth, open loop */
+static int uncore_proc_throttle(const nodemask_t *nodes, int ratio)
+{
+	int node, ret;
+
+	for_each_node_mask(node, *nodes) {
+		if (node >= UNCORE_MAX_SOCKET)
+			return -EINVAL;
+		ret = uncore_imc_set_target(node, UNCORE_IMC_ANY,
+					    UNCORE_IMC_ANY, 0);
+		if (ret)
+			return ret;
+		ret = uncore_imc_set_threshold(node, ratio);
+		if (ret)
+			return ret;
+		bw_ratio[node] = ratio;
+		bw_target[node] = 0;
+	}
+	return 0;
+}
+
+/* Let the controller hold matched channels of @nodes at @mbps */
+static int uncore_proc_target(const nodemask_t *nodes, int mc, int chn,
+			      unsigned int mbps)
+{
+	int node, ret;
+
+	for_each_node_mask(node, *nodes) {
+		ret = uncore_imc_set_target(node, mc, chn, mbps);
+		if (ret)
+			return ret;
+		if (mc == UNCORE_IMC_ANY && chn == UNCORE_IMC_ANY) {
+			/* Stopping brings all channels back to full bandwidth */
+			bw_target[node] = mbps;
+			bw_ratio[node] = 1;
+		} else {
+			bw_target[node] = 0;
+			bw_ratio[node] = 0;
+		}
+	}
+	return 0;
+}
+
+/* Write raw THRT_PWR to @dimms of matched channels of @nodes */
+static int uncore_proc_thrt_pwr(const nodemask_t *nodes, int mc, int chn,
+				unsigned int dimms, unsigned int thrt)
+{
+	int node, ret;
+
+	for_each_node_mask(node, *nodes) {
+		ret = uncore_imc_set_thrt_pwr(node, mc, chn, dimms, thrt);
+		if (ret)
+			return ret;
+		bw_ratio[node] = 0;
+		bw_target[node] = 0;
+	}
+	return 0;
+}
+
 static int uncore_proc_open(struct inode *inode, struct file *file)
 {
 	return single_open(file, pmu_proc_show, NULL);
 }
 
 /*
- * Control behaviour of the underlying module in a predefined manner
+ * Control behaviour of the underlying module in a predefined manner.
+ * Write "<cmd> [nodelist]", e.g. "2 1-3". Without a node list, throttling
+ * applies to all online nodes, and benchmark runs on node 0.
+ *
+ * "t <MB/s> [nodelist] [channel]" holds each channel at the given bandwidth,
+ * closed loop, e.g. "t 6600 1". "t 0" stops it.
+ *
+ * "p <THRT_PWR> [nodelist] [channel]" writes a raw THRT_PWR, open loop.
+ *
+ * A channel is "c<mc>.<channel>[/<dimm mask>]", e.g. "p 0x7f 1 c0.2/0x4"
+ * throttles the third DIMM of channel 2 of IMC 0 on node 1 only. Without
+ * it, all channels of the listed nodes are changed.
  */
 static ssize_t uncore_proc_write(struct file *file, const char __user *buf,
 				 size_t count,  loff_t *offs)
 {
-	char ctl[2];
+	char ctl[64], *list, *arg, *sel;
+	unsigned int value = 0, dimms = UNCORE_IMC_ALL_DIMMS;
+	int mc = UNCORE_IMC_ANY, chn = UNCORE_IMC_ANY;
+	nodemask_t nodes;
+	int ret = 0;
 	
-	if (count !=2 || *offs)
+	if (!count || count >= sizeof(ctl) || *offs)
 		return -EINVAL;
 	
 	if (copy_from_user(ctl, buf, count))
 		return -EFAULT;
+	ctl[count] = '\0';
+
+	list = strim(ctl + 1);
+	if (ctl[0] == 't' || ctl[0] == 'p') {
+		arg = strsep(&list, " \t");
+		if (kstrtouint(arg, 0, &value))
+			return -EINVAL;
+		list = list ? strim(list) : "";
+
+		/* Node lists have no 'c', so it starts the channel */
+		sel = strchr(list, 'c');
+		if (sel) {
+			if (sscanf(sel, "c%d.%d/%i", &mc, &chn, &dimms) < 2 ||
+			    mc < 0 || chn < 0)
+				return -EINVAL;
+			/* Controller counts whole channels */
+			if (ctl[0] == 't' && dimms != UNCORE_IMC_ALL_DIMMS)
+				return -EINVAL;
+			*sel = '\0';
+			list = strim(list);
+		}
+	}
+
+	/* Every listed node must be online */
+	if (*list) {
+		if (nodelist_parse(list, nodes) || nodes_empty(nodes) ||
+		    !nodes_subset(nodes, node_online_map))
+			return -EINVAL;
+	} else {
+		nodes = node_online_map;
+	}
 	
 	mutex_lock(&uncore_proc_mutex);
 	switch (ctl[0]) {
 		case '0':/* 1/1 Bandwidth */
-			bw_ratio = 1;
-			uncore_imc_set_threshold(0, 1);
-			uncore_imc_set_threshold(1, 1);
+			ret = uncore_proc_throttle(&nodes, 1);
 			break;
 		case '2':/* 1/2 Bandwidth */
-			bw_ratio = 2;
-			uncore_imc_set_threshold(0, 2);
-			uncore_imc_set_threshold(1, 2);
+			ret = uncore_proc_throttle(&nodes, 2);
 			break;
 		case '4':/* 1/4 Bandwidth */
-			bw_ratio = 4;
-			uncore_imc_set_threshold(0, 4);
-			uncore_imc_set_threshold(1, 4);
+			ret = uncore_proc_throttle(&nodes, 4);
+			break;
+		case 't':/* Bandwidth target */
+			ret = uncore_proc_target(&nodes, mc, chn, value);
+			break;
+		case 'p':/* Raw THRT_PWR */
+			ret = uncore_proc_thrt_pwr(&nodes, mc, chn, dimms, value);
+			break;
+		case 'b':/* Benchmark counter reads */
+			ret = uncore_proc_bench(*list ? first_node(nodes) : 0);
 			break;
 		default:
-			count = -EINVAL;
+			ret = -EINVAL;
 	}
 	mutex_unlock(&uncore_proc_mutex);
 
-	return count;
+	return ret ? ret : count;
 }
 
 const struct file_operations uncore_proc_fops = {
@@ -0,0 +1,246 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define pr_fmt(fmt) "UNCORE RING: " fmt
+
+/*
+ * Per-socket sample rings, see uncore_ring.h for the layout.
+ *
+ * The poller of a socket appends one record per poll, with no lock and no
+ * wait, so it works at any epoch length. Userspace maps the ring through
+ * /dev/uncore_ring<node> and reads it in place.
+ */
+
+#include "uncore_pmu.h"
+#include "uncore_ring.h"
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/nodemask.h>
+#include <linux/miscdevice.h>
+#include <linux/moduleparam.h>
+
+/*
+ * Records of each ring. 65536 records last 0.65 seconds at 10 us epochs,
+ * consumers have to keep up with that.
+ */
+static unsigned int ring_records = 65536;
+module_param(ring_records, uint, 0444);
+MODULE_PARM_DESC(ring_records, "Records per socket ring, power of 2 (default: 65536)");
+
+/**
+ * struct uncore_ring
+ * @misc:	the char device
+ * @name:	storage of misc.name
+ * @header:	start of the mapping
+ * @records:	right after the header page
+ * @size:	bytes of the mapping
+ * @registed:	whether @misc is registered
+ */
+struct uncore_ring {
+	struct miscdevice		misc;
+	char				name[16];
+	struct uncore_ring_header	*header;
+	struct uncore_ring_record	*records;
+	size_t				size;
+	bool				registed;
+};
+
+static struct uncore_ring *uncore_rings[UNCORE_MAX_SOCKET];
+
+/**
+ * uncore_ring_set_layout
+ * @nodeid:	socket of the ring
+ * @names:	what each value of following records is
+ * @nr:		number of @names
+ *
+ * Describe values of records to consumers. Call it from the producer.
+ */
+void uncore_ring_set_layout(unsigned int nodeid, const char * const *names,
+			    unsigned int nr)
+{
+	struct uncore_ring_header *header;
+	unsigned int i;
+
+	if (nodeid >= UNCORE_MAX_SOCKET || !uncore_rings[nodeid])
+		return;
+
+	header = uncore_rings[nodeid]->header;
+	nr = min_t(unsigned int, nr, UNCORE_RING_MAX_VALUES);
+
+	for (i = 0; i < nr; i++)
+		strlcpy(header->names[i], names[i], UNCORE_RING_NAME_LEN);
+	header->nr_names = nr;
+
+	smp_wmb();
+	WRITE_ONCE(header->layout_seq, header->layout_seq + 1);
+}
+
+/**
+ * uncore_ring_write
+ * @nodeid:	socket of the ring
+ * @period_ns:	time covered by @values
+ * @values:	counts to append
+ * @nr:		number of @values
+ *
+ * Append a record to the ring of @nodeid, overwriting the oldest one if the
+ * ring is full. Only the poller of @nodeid may call it, it is not safe with
+ * two producers. Safe in any context.
+ */
+void uncore_ring_write(unsigned int nodeid, u64 period_ns,
+		       const u64 *values, unsigned int nr)
+{
+	struct uncore_ring *ring;
+	struct uncore_ring_record *rec;
+	u64 head;
+
+	if (nodeid >= UNCORE_MAX_SOCKET || !uncore_rings[nodeid])
+		return;
+
+	ring = uncore_rings[nodeid];
+	nr = min_t(unsigned int, nr, UNCORE_RING_MAX_VALUES);
+	head = ring->header->head;
+
+	rec = &ring->records[head & (ring->header->nr_records - 1)];
+	rec->time_ns = ktime_get_ns();
+	rec->period_ns = min_t(u64, period_ns, U32_MAX);
+	rec->nr_values = nr;
+	memcpy(rec->values, values, nr * sizeof(u64));
+
+	/* Record must be visible before it is published */
+	smp_wmb();
+	WRITE_ONCE(ring->header->head, head + 1);
+}
+
+static int uncore_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct miscdevice *misc = file->private_data;
+	struct uncore_ring *ring = container_of(misc, struct uncore_ring, misc);
+
+	/* Only the producer writes */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (vma->vm_end - vma->vm_start + (vma->vm_pgoff << PAGE_SHIFT) > ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->header, vma->vm_pgoff);
+}
+
+static const struct file_operations uncore_ring_fops = {
+	.owner	= THIS_MODULE,
+	.mmap	= uncore_ring_mmap,
+};
+
+static void uncore_ring_free(struct uncore_ring *ring)
+{
+	if (ring->registed)
+		misc_deregister(&ring->misc);
+	vfree(ring->header);
+	kfree(ring);
+}
+
+static int uncore_ring_new(unsigned int nodeid)
+{
+	struct uncore_ring *ring;
+	int ret;
+
+	ring = kzalloc_node(sizeof(*ring), GFP_KERNEL, nodeid);
+	if (!ring)
+		return -ENOMEM;
+
+	/* vmalloc_user zeroes pages, and marks them mappable */
+	ring->size = PAGE_SIZE + PAGE_ALIGN(ring_records *
+			sizeof(struct uncore_ring_record));
+	ring->header = vmalloc_user(ring->size);
+	if (!ring->header) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	ring->records = (void *)ring->header + PAGE_SIZE;
+
+	ring->header->version = UNCORE_RING_VERSION;
+	ring->header->nodeid = nodeid;
+	ring->header->record_size = sizeof(struct uncore_ring_record);
+	ring->header->nr_records = ring_records;
+
+	snprintf(ring->name, sizeof(ring->name), "uncore_ring%u", nodeid);
+	ring->misc.minor = MISC_DYNAMIC_MINOR;
+	ring->misc.name = ring->name;
+	ring->misc.fops = &uncore_ring_fops;
+	ring->misc.mode = 0444;
+
+	ret = misc_register(&ring->misc);
+	if (ret) {
+		uncore_ring_free(ring);
+		return ret;
+	}
+	ring->registed = true;
+
+	uncore_rings[nodeid] = ring;
+	return 0;
+}
+
+/**
+ * uncore_ring_init
+ * Return:	Non-zero on failure
+ *
+ * Create a ring for each online node.
+ */
+int uncore_ring_init(void)
+{
+	unsigned int node;
+	int ret;
+
+	if (!ring_records || !is_power_of_2(ring_records)) {
+		pr_err("ring_records must be a power of 2");
+		return -EINVAL;
+	}
+
+	for_each_online_node(node) {
+		if (node >= UNCORE_MAX_SOCKET)
+			break;
+		ret = uncore_ring_new(node);
+		if (ret) {
+			uncore_ring_exit();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void uncore_ring_exit(void)
+{
+	unsigned int node;
+
+	for (node = 0; node < UNCORE_MAX_SOCKET; node++) {
+		if (uncore_rings[node]) {
+			uncore_ring_free(uncore_rings[node]);
+			uncore_rings[node] = NULL;
+		}
+	}
+}
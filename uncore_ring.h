@@ -0,0 +1,90 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Layout of the per-socket sample ring, /dev/uncore_ring<node>.
+ * This file is shared with userspace, keep it free of kernel internals.
+ *
+ * mmap the device read-only: the first page is struct uncore_ring_header,
+ * records follow from the second page on. The poller of the socket is the
+ * only producer, it never waits for consumers and overwrites old records.
+ *
+ * Consumer, remembering tail from last time:
+ *
+ *	head = header->head;  rmb();
+ *	if (head - tail > header->nr_records)
+ *		tail = head - header->nr_records;	(lost some)
+ *	while (tail != head) {
+ *		copy records[tail % header->nr_records];
+ *		rmb();
+ *		if (header->head - tail > header->nr_records)
+ *			drop the copy, it was overwritten while copying;
+ *		tail++;
+ *	}
+ *
+ * values[i] of a record is described by header->names[i]. The producer
+ * bumps layout_seq whenever names change.
+ */
+
+#ifndef _UNCORE_RING_H_
+#define _UNCORE_RING_H_
+
+#include <linux/types.h>
+
+#define UNCORE_RING_VERSION		1
+#define UNCORE_RING_MAX_VALUES		14
+#define UNCORE_RING_NAME_LEN		64
+
+/**
+ * struct uncore_ring_record
+ * @time_ns:	ktime_get_ns() when the sample was taken
+ * @period_ns:	time covered by this sample
+ * @nr_values:	valid entries of @values
+ * @values:	counts within @period_ns, described by header names
+ */
+struct uncore_ring_record {
+	__u64	time_ns;
+	__u32	period_ns;
+	__u32	nr_values;
+	__u64	values[UNCORE_RING_MAX_VALUES];
+};
+
+/**
+ * struct uncore_ring_header
+ * @version:		UNCORE_RING_VERSION
+ * @nodeid:		socket of this ring
+ * @record_size:	sizeof(struct uncore_ring_record)
+ * @nr_records:		records in the ring, a power of 2
+ * @head:		records ever produced, the next one goes to
+ *			head % nr_records
+ * @layout_seq:		bumped whenever @names change
+ * @nr_names:		valid entries of @names
+ * @names:		what each value of records is
+ */
+struct uncore_ring_header {
+	__u32	version;
+	__u32	nodeid;
+	__u32	record_size;
+	__u32	nr_records;
+	__u64	head;
+	__u32	layout_seq;
+	__u32	nr_names;
+	char	names[UNCORE_RING_MAX_VALUES][UNCORE_RING_NAME_LEN];
+};
+
+#endif /* _UNCORE_RING_H_ */
@@ -0,0 +1,821 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define pr_fmt(fmt) "UNCORE SIM: " fmt
+
+/*
+ * Simulated uncore PMU, selected by loading uncore.ko with simulate=1.
+ *
+ * One HA box, one IMC box and one IMC device per node, on at least two
+ * nodes, whatever the machine really has. Registers live in memory. Counters
+ * advance whenever they are touched, by what a generator says happened since
+ * last time:
+ *
+ * const:	a constant rate of reads
+ * trace:	rates replayed from a trace, one entry per step, in a loop
+ * pgfault:	real page faults of the whole system, times a scale
+ *
+ * Writes are a fixed percentage of reads. An event counts writes if it is
+ * a write sub-event of HA REQUESTS or IMC CAS_COUNT, otherwise reads. Both
+ * are bounded by the peak rate of the node, times THRT_PWR/0xfff of its IMCs.
+ *
+ * Tune it through /proc/uncore_sim, see sim_proc_write.
+ */
+
+#include "uncore_pmu.h"
+
+#include <asm/uaccess.h>
+
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/vmstat.h>
+#include <linux/nodemask.h>
+#include <linux/spinlock.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+/* Enough for any real box type */
+#define SIM_MAX_COUNTERS		5
+
+/* Only the bits which matter are modeled, same layout as HSWEP */
+#define SIM_BOX_CTL_FRZ			(1 << 8)
+#define SIM_EVNTSEL_EN			(1 << 22)
+#define SIM_EVNTSEL_UMASK_WR		0x00000C00
+
+/* [thrt_pwr_dimm_[0:2]] of each IMC, like HSWEP */
+#define SIM_DIMMS_PER_CHANNEL		3
+#define SIM_THRT_PWR_MASK		0x0fff
+#define SIM_THRT_PWR_EN			(1 << 15)
+
+#define SIM_MAX_TRACE			4096
+
+enum {
+	SIM_GEN_CONST,
+	SIM_GEN_TRACE,
+	SIM_GEN_PGFAULT,
+
+	SIM_GEN_MAX,
+};
+
+static const char * const sim_gen_names[SIM_GEN_MAX] = {
+	[SIM_GEN_CONST]		= "const",
+	[SIM_GEN_TRACE]		= "trace",
+	[SIM_GEN_PGFAULT]	= "pgfault",
+};
+
+/**
+ * struct sim_box
+ * @box:		the generic box, must be the first member
+ * @lock:		protects all below, hrtimer and /proc race for it
+ * @box_ctl:		box-level control register
+ * @ctl:		counter-level control registers
+ * @ctr:		counter registers
+ * @last_ns:		when counters were advanced last time
+ * @last_pgfault:	page faults of the system by then
+ * @frac:		remainder of reads and writes, below one count
+ */
+struct sim_box {
+	struct uncore_box	box;
+	spinlock_t		lock;
+	u32			box_ctl;
+	u32			ctl[SIM_MAX_COUNTERS];
+	u64			ctr[SIM_MAX_COUNTERS];
+	u64			last_ns;
+	unsigned long		last_pgfault;
+	u64			frac[2];
+};
+
+/**
+ * struct sim_imc
+ * @imc:		the generic imc, must be the first member
+ * @thrt_pwr:		THRT_PWR register of each DIMM
+ */
+struct sim_imc {
+	struct uncore_imc	imc;
+	u16			thrt_pwr[SIM_DIMMS_PER_CHANNEL];
+};
+
+/* Generator, all rates are counts per millisecond */
+static unsigned int sim_gen = SIM_GEN_CONST;
+static u64 sim_rate = 10000;
+static u64 sim_peak_rate = 100000;
+static u64 sim_write_pct = 30;
+static u64 sim_pgfault_scale = 64;
+static u64 sim_step_ns = NSEC_PER_MSEC;
+
+static u64 *sim_trace;
+static unsigned int sim_trace_len;
+static DEFINE_SPINLOCK(sim_trace_lock);
+
+/* Lowest enabled THRT_PWR of each node */
+static u32 sim_node_thrt[UNCORE_MAX_SOCKET] = {
+	[0 ... UNCORE_MAX_SOCKET - 1] = SIM_THRT_PWR_MASK,
+};
+
+static inline struct sim_box *to_sim_box(struct uncore_box *box)
+{
+	return container_of(box, struct sim_box, box);
+}
+
+static inline struct sim_imc *to_sim_imc(struct uncore_imc *imc)
+{
+	return container_of(imc, struct sim_imc, imc);
+}
+
+/* Pretend there are two sockets at least, emulation wants an NVM node */
+static unsigned int sim_nodes(void)
+{
+	return clamp_t(unsigned int, num_online_nodes(), 2, UNCORE_MAX_SOCKET);
+}
+
+/*
+ * all_vm_events() may sleep, sum up per-cpu counters by hand. Dead cpus
+ * fold their events into a live one, so the sum never goes backwards.
+ */
+static unsigned long sim_pgfaults(void)
+{
+	unsigned long sum = 0;
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(vm_event_states, cpu).event[PGFAULT];
+#endif
+	return sum;
+}
+
+static u64 sim_trace_rate(u64 now)
+{
+	unsigned long flags;
+	u64 rate = 0;
+
+	spin_lock_irqsave(&sim_trace_lock, flags);
+	if (sim_trace_len)
+		rate = sim_trace[div64_u64(now, sim_step_ns) % sim_trace_len];
+	spin_unlock_irqrestore(&sim_trace_lock, flags);
+
+	return rate;
+}
+
+/* @num / @den, carrying the remainder over in @frac */
+static u64 sim_div_frac(u64 num, u64 den, u64 *frac)
+{
+	u64 q, rem;
+
+	q = div64_u64_rem(num + *frac, den, &rem);
+	*frac = rem;
+	return q;
+}
+
+/* Reads of @sb in the last @dt ns */
+static u64 sim_gen_reads(struct sim_box *sb, u64 now, u64 dt)
+{
+	unsigned long faults;
+	u64 rate, reads, cap;
+
+	cap = div_u64(READ_ONCE(sim_peak_rate) *
+		      READ_ONCE(sim_node_thrt[sb->box.nodeid]),
+		      SIM_THRT_PWR_MASK);
+
+	switch (READ_ONCE(sim_gen)) {
+	case SIM_GEN_PGFAULT:
+		faults = sim_pgfaults();
+		reads = (faults - sb->last_pgfault) * READ_ONCE(sim_pgfault_scale);
+		sb->last_pgfault = faults;
+		return min(reads, div64_u64(cap * dt, NSEC_PER_MSEC));
+	case SIM_GEN_TRACE:
+		rate = sim_trace_rate(now);
+		break;
+	default:
+		rate = READ_ONCE(sim_rate);
+	}
+
+	return sim_div_frac(min(rate, cap) * dt, NSEC_PER_MSEC, &sb->frac[0]);
+}
+
+/*
+ * Bring counters of @sb up to now. Frozen time is skipped, just like
+ * hardware which does not count while frozen. Called with lock held.
+ */
+static void sim_box_advance(struct sim_box *sb)
+{
+	u64 now, dt, reads, writes;
+	int i;
+
+	now = ktime_get_ns();
+	dt = now - sb->last_ns;
+	sb->last_ns = now;
+
+	if (sb->box_ctl & SIM_BOX_CTL_FRZ)
+		return;
+
+	reads = sim_gen_reads(sb, now, dt);
+	writes = sim_div_frac(reads * READ_ONCE(sim_write_pct), 100, &sb->frac[1]);
+
+	for (i = 0; i < SIM_MAX_COUNTERS; i++) {
+		if (!(sb->ctl[i] & SIM_EVNTSEL_EN))
+			continue;
+		sb->ctr[i] += (sb->ctl[i] & SIM_EVNTSEL_UMASK_WR) ? writes : reads;
+		sb->ctr[i] &= uncore_box_ctr_mask(&sb->box);
+	}
+}
+
+/******************************************************************************
+ * Box Type
+ *****************************************************************************/
+
+static void sim_show_box(struct uncore_box *box)
+{
+	struct sim_box *sb = to_sim_box(box);
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	sim_box_advance(sb);
+
+	pr_info("\033[034m---------------------- Show Sim Box ----------------------\033[0m");
+	pr_info("Sim Box %d, on Node %d, %s", box->idx, box->nodeid,
+		box->box_type->name);
+	pr_info("Sim Box-level Control: 0x%x", sb->box_ctl);
+
+	for (i = 0; i < UNCORE_BOX_MAX_EVENTS; i++) {
+		if (box->events[i])
+			pr_info("... Event of Counter %u: %s", i, box->events[i]->desc);
+	}
+
+	for (i = 0; i < box->box_type->num_counters; i++) {
+		pr_info("... Control Register %u: 0x%x", i, sb->ctl[i]);
+		pr_info("... Counter Register %u: %Ld", i, sb->ctr[i]);
+	}
+	spin_unlock_irqrestore(&sb->lock, flags);
+}
+
+static void sim_init_box(struct uncore_box *box)
+{
+	struct sim_box *sb = to_sim_box(box);
+	unsigned long flags;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	sb->box_ctl = 0;
+	memset(sb->ctl, 0, sizeof(sb->ctl));
+	memset(sb->ctr, 0, sizeof(sb->ctr));
+	memset(sb->frac, 0, sizeof(sb->frac));
+	sb->last_ns = ktime_get_ns();
+	sb->last_pgfault = sim_pgfaults();
+	spin_unlock_irqrestore(&sb->lock, flags);
+}
+
+static void sim_enable_box(struct uncore_box *box)
+{
+	struct sim_box *sb = to_sim_box(box);
+	unsigned long flags;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	sim_box_advance(sb);
+	sb->box_ctl &= ~SIM_BOX_CTL_FRZ;
+	spin_unlock_irqrestore(&sb->lock, flags);
+}
+
+static void sim_disable_box(struct uncore_box *box)
+{
+	struct sim_box *sb = to_sim_box(box);
+	unsigned long flags;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	sim_box_advance(sb);
+	sb->box_ctl |= SIM_BOX_CTL_FRZ;
+	spin_unlock_irqrestore(&sb->lock, flags);
+}
+
+static void sim_write_ctl(struct uncore_box *box, unsigned int idx, u32 value)
+{
+	struct sim_box *sb = to_sim_box(box);
+	unsigned long flags;
+
+	if (idx >= SIM_MAX_COUNTERS)
+		return;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	sim_box_advance(sb);
+	sb->ctl[idx] = value;
+	spin_unlock_irqrestore(&sb->lock, flags);
+}
+
+static void sim_enable_event(struct uncore_box *box, unsigned int idx,
+			     struct uncore_event *event)
+{
+	sim_write_ctl(box, idx, event->enable);
+}
+
+static void sim_disable_event(struct uncore_box *box, unsigned int idx,
+			      struct uncore_event *event)
+{
+	sim_write_ctl(box, idx, event->disable);
+}
+
+static void sim_write_counter(struct uncore_box *box, unsigned int idx,
+			      u64 value)
+{
+	struct sim_box *sb = to_sim_box(box);
+	unsigned long flags;
+
+	if (idx >= SIM_MAX_COUNTERS)
+		return;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	sim_box_advance(sb);
+	sb->ctr[idx] = value & uncore_box_ctr_mask(box);
+	spin_unlock_irqrestore(&sb->lock, flags);
+}
+
+static void sim_read_counter(struct uncore_box *box, unsigned int idx,
+			     u64 *value)
+{
+	struct sim_box *sb = to_sim_box(box);
+	unsigned long flags;
+
+	if (idx >= SIM_MAX_COUNTERS)
+		return;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	sim_box_advance(sb);
+	*value = sb->ctr[idx];
+	spin_unlock_irqrestore(&sb->lock, flags);
+}
+
+static const struct uncore_box_ops SIM_UNCORE_BOX_OPS = {
+	.show_box	= sim_show_box,
+	.init_box	= sim_init_box,
+	.clear_box	= sim_init_box,
+	.enable_box	= sim_enable_box,
+	.disable_box	= sim_disable_box,
+	.enable_event	= sim_enable_event,
+	.disable_event	= sim_disable_event,
+	.write_counter	= sim_write_counter,
+	.read_counter	= sim_read_counter
+};
+
+static struct uncore_box_type SIM_UNCORE_HA = {
+	.name		= "Sim-HA-Box",
+	.num_counters	= 4,
+	.perf_ctr_bits	= 48,
+	.ops		= &SIM_UNCORE_BOX_OPS
+};
+
+static struct uncore_box_type SIM_UNCORE_IMC = {
+	.name		= "Sim-IMC-Box",
+	.num_counters	= 4,
+	.perf_ctr_bits	= 48,
+	.ops		= &SIM_UNCORE_BOX_OPS
+};
+
+static struct uncore_box_type *SIM_UNCORE_PCI_TYPE[] = {
+	[UNCORE_PCI_HA_ID]	= &SIM_UNCORE_HA,
+	[UNCORE_PCI_IMC_ID]	= &SIM_UNCORE_IMC,
+	NULL
+};
+
+static struct uncore_box_type *SIM_UNCORE_MSR_TYPE[] = {
+	NULL
+};
+
+int sim_cpu_init(void)
+{
+	uncore_msr_type = SIM_UNCORE_MSR_TYPE;
+
+	/* No global MSRs, uncore_pmu skips zero addresses */
+	uncore_pmu.name		= "Simulated Uncore PMU";
+	uncore_pmu.msr_type	= SIM_UNCORE_MSR_TYPE;
+
+	return 0;
+}
+
+/*
+ * Boxes are freed by uncore_pci_exit, also if we fail halfway here.
+ */
+int sim_pci_init(void)
+{
+	struct uncore_box_type *type;
+	struct sim_box *sb;
+	unsigned int node;
+	int i, ret;
+
+	uncore_pci_type		= SIM_UNCORE_PCI_TYPE;
+	uncore_pmu.pci_type	= SIM_UNCORE_PCI_TYPE;
+
+	for (i = 0; uncore_pci_type[i]; i++) {
+		type = uncore_pci_type[i];
+		INIT_LIST_HEAD(&type->box_list);
+		type->num_boxes = 1;
+
+		for (node = 0; node < sim_nodes(); node++) {
+			sb = uncore_alloc_box(sizeof(struct sim_box), node);
+			if (!sb)
+				return -ENOMEM;
+
+			spin_lock_init(&sb->lock);
+			sb->last_ns = ktime_get_ns();
+			ret = uncore_add_box(&sb->box, type, 0, node);
+			if (ret) {
+				kfree(sb);
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * IMC Part
+ *****************************************************************************/
+
+static void sim_imc_update_node(unsigned int nodeid)
+{
+	struct uncore_imc *imc;
+	u32 thrt = SIM_THRT_PWR_MASK;
+	u16 config;
+	int i;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (imc->nodeid != nodeid)
+			continue;
+		for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++) {
+			config = to_sim_imc(imc)->thrt_pwr[i];
+			if (config & SIM_THRT_PWR_EN)
+				thrt = min_t(u32, thrt, config & SIM_THRT_PWR_MASK);
+		}
+	}
+
+	WRITE_ONCE(sim_node_thrt[nodeid], thrt);
+}
+
+/*
+ * Nobody knows how THRT_PWR relates to bandwidth on real hardware (see
+ * hswep_imc_set_threshold), the simulation keeps the 1/threshold promise.
+ */
+static int sim_imc_set_threshold(struct uncore_imc *imc, unsigned int threshold)
+{
+	struct sim_imc *si = to_sim_imc(imc);
+	int i;
+
+	if (!threshold)
+		return -EINVAL;
+
+	for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++) {
+		si->thrt_pwr[i] &= SIM_THRT_PWR_EN;
+		si->thrt_pwr[i] |= SIM_THRT_PWR_MASK / threshold;
+	}
+
+	sim_imc_update_node(imc->nodeid);
+	return 0;
+}
+
+/* The slowest DIMM of a node bounds all of it, there is no address map */
+static void sim_imc_set_thrt_pwr(struct uncore_imc *imc, unsigned int dimms,
+				 unsigned int thrt)
+{
+	struct sim_imc *si = to_sim_imc(imc);
+	int i;
+
+	for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++) {
+		if (!(dimms & (1 << i)))
+			continue;
+		si->thrt_pwr[i] &= SIM_THRT_PWR_EN;
+		si->thrt_pwr[i] |= thrt & SIM_THRT_PWR_MASK;
+	}
+
+	sim_imc_update_node(imc->nodeid);
+}
+
+static int sim_imc_enable_throttle(struct uncore_imc *imc)
+{
+	struct sim_imc *si = to_sim_imc(imc);
+	int i;
+
+	for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++)
+		si->thrt_pwr[i] |= SIM_THRT_PWR_EN;
+
+	sim_imc_update_node(imc->nodeid);
+	return 0;
+}
+
+static void sim_imc_disable_throttle(struct uncore_imc *imc)
+{
+	struct sim_imc *si = to_sim_imc(imc);
+	int i;
+
+	for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++)
+		si->thrt_pwr[i] &= ~SIM_THRT_PWR_EN;
+
+	sim_imc_update_node(imc->nodeid);
+}
+
+static void sim_imc_save_thrt_pwr(struct uncore_imc *imc, u16 *regs)
+{
+	struct sim_imc *si = to_sim_imc(imc);
+	int i;
+
+	for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++)
+		regs[i] = si->thrt_pwr[i];
+}
+
+static void sim_imc_restore_thrt_pwr(struct uncore_imc *imc, const u16 *regs)
+{
+	struct sim_imc *si = to_sim_imc(imc);
+	int i;
+
+	for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++)
+		si->thrt_pwr[i] = regs[i];
+
+	sim_imc_update_node(imc->nodeid);
+}
+
+static const struct uncore_imc_ops SIM_IMC_OPS = {
+	.set_threshold		= sim_imc_set_threshold,
+	.set_thrt_pwr		= sim_imc_set_thrt_pwr,
+	.enable_throttle	= sim_imc_enable_throttle,
+	.disable_throttle	= sim_imc_disable_throttle,
+	.save_thrt_pwr		= sim_imc_save_thrt_pwr,
+	.restore_thrt_pwr	= sim_imc_restore_thrt_pwr
+};
+
+/*
+ * IMCs are freed by uncore_imc_exit, also if we fail halfway here.
+ */
+int sim_imc_init(void)
+{
+	struct sim_imc *si;
+	unsigned int node;
+	int i;
+
+	uncore_imc_ops = &SIM_IMC_OPS;
+
+	for (node = 0; node < sim_nodes(); node++) {
+		si = kzalloc(sizeof(struct sim_imc), GFP_KERNEL);
+		if (!si)
+			return -ENOMEM;
+
+		/* Default value after hardware reset */
+		for (i = 0; i < SIM_DIMMS_PER_CHANNEL; i++)
+			si->thrt_pwr[i] = SIM_THRT_PWR_EN | SIM_THRT_PWR_MASK;
+
+		si->imc.nodeid = node;
+		si->imc.ops = &SIM_IMC_OPS;
+		list_add_tail(&si->imc.next, &uncore_imc_devices);
+		sim_imc_update_node(node);
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * /proc Part
+ *****************************************************************************/
+
+static DEFINE_MUTEX(sim_proc_mutex);
+
+static int sim_proc_show(struct seq_file *m, void *v)
+{
+	struct uncore_box_type *type;
+	struct uncore_box *box;
+	unsigned long flags;
+	unsigned int node;
+	int i;
+
+	seq_printf(m, "gen = %s, rate = %llu, peak = %llu, write_pct = %llu\n",
+		sim_gen_names[sim_gen], sim_rate, sim_peak_rate, sim_write_pct);
+	seq_printf(m, "scale = %llu, step_us = %llu, trace entries = %u\n",
+		sim_pgfault_scale, div_u64(sim_step_ns, NSEC_PER_USEC),
+		sim_trace_len);
+
+	for (node = 0; node < sim_nodes(); node++)
+		seq_printf(m, "Node %u, THRT_PWR = 0x%x\n", node,
+			READ_ONCE(sim_node_thrt[node]));
+
+	for (i = 0; uncore_pci_type[i]; i++) {
+		type = uncore_pci_type[i];
+		list_for_each_entry(box, &type->box_list, next) {
+			struct sim_box *sb = to_sim_box(box);
+
+			spin_lock_irqsave(&sb->lock, flags);
+			sim_box_advance(sb);
+			seq_printf(m, "%s %u, Node %u, %s, ctr = %llu %llu %llu %llu\n",
+				type->name, box->idx, box->nodeid,
+				sb->box_ctl & SIM_BOX_CTL_FRZ ? "frozen" : "counting",
+				sb->ctr[0], sb->ctr[1], sb->ctr[2], sb->ctr[3]);
+			spin_unlock_irqrestore(&sb->lock, flags);
+		}
+	}
+
+	return 0;
+}
+
+static int sim_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sim_proc_show, NULL);
+}
+
+/* Page faults of the past must not land in the first sample */
+static void sim_sync_pgfault(void)
+{
+	struct uncore_box *box;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; uncore_pci_type[i]; i++) {
+		list_for_each_entry(box, &uncore_pci_type[i]->box_list, next) {
+			struct sim_box *sb = to_sim_box(box);
+
+			spin_lock_irqsave(&sb->lock, flags);
+			sim_box_advance(sb);
+			sb->last_pgfault = sim_pgfaults();
+			spin_unlock_irqrestore(&sb->lock, flags);
+		}
+	}
+}
+
+static int sim_proc_gen(char *val)
+{
+	unsigned int gen;
+
+	for (gen = 0; gen < SIM_GEN_MAX; gen++) {
+		if (!strcmp(val, sim_gen_names[gen])) {
+			if (gen == SIM_GEN_PGFAULT)
+				sim_sync_pgfault();
+			WRITE_ONCE(sim_gen, gen);
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int sim_proc_trace(char *val, bool append)
+{
+	unsigned int len = 0;
+	unsigned long flags;
+	u64 *new, *old;
+	char *tok;
+	int ret = 0;
+
+	new = kmalloc_array(SIM_MAX_TRACE, sizeof(u64), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	/* Only we change the trace, it is stable under sim_proc_mutex */
+	if (append) {
+		len = sim_trace_len;
+		memcpy(new, sim_trace, len * sizeof(u64));
+	}
+
+	while (!ret && (tok = strsep(&val, ","))) {
+		if (!*tok)
+			continue;
+		if (len >= SIM_MAX_TRACE)
+			ret = -ENOSPC;
+		else
+			ret = kstrtoull(tok, 0, &new[len++]);
+	}
+
+	if (ret) {
+		kfree(new);
+		return ret;
+	}
+
+	spin_lock_irqsave(&sim_trace_lock, flags);
+	old = sim_trace;
+	sim_trace = new;
+	sim_trace_len = len;
+	spin_unlock_irqrestore(&sim_trace_lock, flags);
+
+	kfree(old);
+	return 0;
+}
+
+#define SIM_PROC_U64(_name, _var, _mult)	{ _name "=", &(_var), (_mult) }
+
+static const struct {
+	const char	*key;
+	u64		*var;
+	u64		mult;
+} sim_proc_u64s[] = {
+	SIM_PROC_U64("rate",		sim_rate,		1),
+	SIM_PROC_U64("peak",		sim_peak_rate,		1),
+	SIM_PROC_U64("write_pct",	sim_write_pct,		1),
+	SIM_PROC_U64("scale",		sim_pgfault_scale,	1),
+	SIM_PROC_U64("step_us",		sim_step_ns,		NSEC_PER_USEC),
+};
+
+static int sim_proc_u64(char *p)
+{
+	size_t len;
+	u64 v;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(sim_proc_u64s); i++) {
+		len = strlen(sim_proc_u64s[i].key);
+		if (strncmp(p, sim_proc_u64s[i].key, len))
+			continue;
+
+		ret = kstrtoull(p + len, 0, &v);
+		if (ret)
+			return ret;
+
+		/* Trace steps of zero length make no sense */
+		if (sim_proc_u64s[i].var == &sim_step_ns && !v)
+			return -EINVAL;
+
+		WRITE_ONCE(*sim_proc_u64s[i].var, v * sim_proc_u64s[i].mult);
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+ * gen=<const|trace|pgfault>	Choose the generator
+ * rate=<n>			Reads per ms, const generator
+ * peak=<n>			Reads per ms at most, without throttling
+ * write_pct=<n>		Writes per 100 reads
+ * scale=<n>			Reads per page fault, pgfault generator
+ * step_us=<n>			How long each trace entry lasts
+ * trace=<n,n,...>		Reads per ms of each step, replace the trace
+ * trace+=<n,n,...>		Append to the trace
+ */
+static ssize_t sim_proc_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *offs)
+{
+	char ctl[256], *p;
+	int ret;
+
+	if (count >= sizeof(ctl) || *offs)
+		return -EINVAL;
+
+	if (copy_from_user(ctl, buf, count))
+		return -EFAULT;
+	ctl[count] = '\0';
+	p = strim(ctl);
+
+	mutex_lock(&sim_proc_mutex);
+	if (!strncmp(p, "gen=", 4))
+		ret = sim_proc_gen(p + 4);
+	else if (!strncmp(p, "trace=", 6))
+		ret = sim_proc_trace(p + 6, false);
+	else if (!strncmp(p, "trace+=", 7))
+		ret = sim_proc_trace(p + 7, true);
+	else
+		ret = sim_proc_u64(p);
+	mutex_unlock(&sim_proc_mutex);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations sim_proc_fops = {
+	.open		= sim_proc_open,
+	.read		= seq_read,
+	.write		= sim_proc_write,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+static bool is_proc_registed = false;
+
+int __must_check sim_proc_create(void)
+{
+	if (proc_create("uncore_sim", 0644, NULL, &sim_proc_fops)) {
+		is_proc_registed = true;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+void sim_proc_remove(void)
+{
+	if (is_proc_registed)
+		remove_proc_entry("uncore_sim", NULL);
+
+	kfree(sim_trace);
+	sim_trace = NULL;
+	sim_trace_len = 0;
+}